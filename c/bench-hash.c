@@ -0,0 +1,201 @@
+/*
+ * microbenchmark of hashing alone: blake2b_zcash, blake2b_zcash4 and
+ * blake2b_update/final for every x86 BLAKE2b backend the cpu has,
+ * and double sha256 of a block.  outputs of each backend are folded
+ * into a checksum which must match the reference one
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include "blake2b.h"
+#include "blake2b-dispatch/variants.h"
+#include "sha256/sha256.h"
+#include "equihash.h"
+
+/* reference first, the others are checked against it */
+static variant_t	variants[] = {
+	VARIANT (ref),
+	VARIANT (sse2),
+	VARIANT (sse41),
+	VARIANT (avx2),
+};
+
+#define VARIANTS	((int)(sizeof (variants) / sizeof (variants[0])))
+#define HASHES		(1 << 20)	/* zcash ones, per test */
+#define HASHES_SLOW	(1 << 18)	/* update/final and sha256 */
+
+typedef struct {
+	char		*name;
+	int		hashes;
+	double		sec;
+	uint64_t	cycles;
+	uint8_t		sum[BLAKE2B_OUTBYTES];
+} result_t;
+
+static block_t		block;
+static blake2b_state	state;
+
+static double
+now (void) {
+	struct timespec	ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+fold (uint8_t *sum, uint8_t *out, int len) {
+	int		i;
+
+	for (i = 0; i < len; i++)
+		sum[i % BLAKE2B_OUTBYTES] += out[i] ^ i;
+}
+
+static void
+block_init (void) {
+	int		i;
+
+	for (i = 0; i < (int)sizeof (block); i++)
+		((uint8_t *)&block)[i] = i * 7 + 1;
+}
+
+static void
+param_init (blake2b_param *P) {
+	memset (P, 0, sizeof (*P));
+	memcpy (P->personal, "ZcashPoW", 8);
+	P->personal[8] = WN;
+	P->personal[12] = WK;
+	P->digest_length = BLAKE2B_ZCASH_BYTES;
+	P->fanout = 1;
+	P->depth = 1;
+}
+
+#define TIMED(r,n,body) do { \
+	double		t0 = now (); \
+	uint64_t	c0 = __rdtsc (); \
+	\
+	body; \
+	(r)->cycles = __rdtsc () - c0; \
+	(r)->sec = now () - t0; \
+	(r)->hashes = (n); \
+} while (0)
+
+static void
+bench_zcash (variant_t *v, result_t *r) {
+	uint8_t		out[BLAKE2B_ZCASH_BYTES];
+	int		i;
+
+	r->name = "zcash";
+	TIMED (r, HASHES, for (i = 0; i < HASHES; i++) {
+		v->zcash (&state, i, out);
+		fold (r->sum, out, BLAKE2B_ZCASH_BYTES);
+	});
+}
+
+static void
+bench_zcash4 (variant_t *v, result_t *r) {
+	uint8_t		out[4 * BLAKE2B_ZCASH_BYTES];
+	int		i, j;
+
+	r->name = "zcash4";
+	TIMED (r, HASHES, for (i = 0; i < HASHES; i += 4) {
+		v->zcash4 (&state, i, out);
+		for (j = 0; j < 4; j++)
+			fold (r->sum, out + BLAKE2B_ZCASH_BYTES * j,
+			    BLAKE2B_ZCASH_BYTES);
+	});
+}
+
+/* the whole header and index through the streaming API */
+static void
+bench_update (variant_t *v, result_t *r) {
+	blake2b_param	P;
+	blake2b_state	S;
+	uint8_t		out[BLAKE2B_ZCASH_BYTES];
+	int		i;
+
+	r->name = "update_final";
+	param_init (&P);
+	TIMED (r, HASHES_SLOW, for (i = 0; i < HASHES_SLOW; i++) {
+		memcpy (block.nonce, &i, sizeof (i));
+		v->init_param (&S, &P);
+		v->update (&S, (uint8_t *)&block,
+		    block.solsize - block.version);
+		v->update (&S, (uint8_t *)&i, sizeof (i));
+		v->final (&S, out, sizeof (out));
+		fold (r->sum, out, sizeof (out));
+	});
+}
+
+static void
+bench_sha256 (result_t *r) {
+	uint8_t		tmp[SHA256_DIGEST_SIZE], out[SHA256_DIGEST_SIZE];
+	int		i;
+
+	r->name = "sha256d";
+	TIMED (r, HASHES_SLOW, for (i = 0; i < HASHES_SLOW; i++) {
+		memcpy (block.nonce, &i, sizeof (i));
+		sha256 ((uint8_t *)&block, sizeof (block), tmp);
+		sha256 (tmp, sizeof (tmp), out);
+		fold (r->sum, out, sizeof (out));
+	});
+}
+
+static void
+report (char *backend, result_t *r, result_t *ref) {
+	printf ("%-8s %-14s %10.3f Mhash/s %10.1f cycles/hash  %s\n",
+	    backend, r->name, r->hashes / r->sec / 1e6,
+	    (double)r->cycles / r->hashes,
+	    !ref ? "reference" :
+	    !memcmp (r->sum, ref->sum, sizeof (r->sum)) ? "same" : "DIFFERS");
+}
+
+int
+main (void) {
+	blake2b_param	P;
+	result_t	ref[3], r[3];
+	int		i, bad = 0;
+
+	__builtin_cpu_init ();
+	variants[0].supported = 1;
+	variants[1].supported = __builtin_cpu_supports ("sse2");
+	variants[2].supported = __builtin_cpu_supports ("sse4.1");
+	variants[3].supported = __builtin_cpu_supports ("avx2");
+
+	for (i = 0; i < VARIANTS; i++) {
+		variant_t	*v = &variants[i];
+		result_t	*res = i ? r : ref;
+		int		j;
+
+		if (!v->supported) {
+			printf ("%-8s not supported by cpu\n", v->name);
+			continue;
+		}
+		/* header state of zcash hashes comes from the variant too */
+		block_init ();
+		param_init (&P);
+		v->init_param (&state, &P);
+		v->update (&state, (uint8_t *)&block,
+		    block.solsize - block.version);
+
+		memset (res, 0, sizeof (r));
+		bench_zcash (v, &res[0]);
+		bench_zcash4 (v, &res[1]);
+		bench_update (v, &res[2]);
+		for (j = 0; j < 3; j++) {
+			report (v->name, &res[j], i ? &ref[j] : NULL);
+			if (i && memcmp (res[j].sum, ref[j].sum,
+			    sizeof (res[j].sum)))
+				bad = 1;
+		}
+	}
+
+	block_init ();
+	memset (r, 0, sizeof (r));
+	bench_sha256 (&r[0]);
+	report ("sha256", &r[0], NULL);
+	return bad;
+}
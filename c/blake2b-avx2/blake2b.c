@@ -0,0 +1,152 @@
+/*
+ * BLAKE2b for AVX2, zcash hashes are computed 4 at a time,
+ * one per 64-bit lane, and stored in the order equihash consumes
+ * them.  rounds follow the reference implementation by Samuel Neves.
+ * one hash at a time has no lanes to fill, the SSE4.1 code (built
+ * with VEX here) does those
+ */
+
+#if !defined(__AVX2__)
+#error "This code requires AVX2."
+#endif
+
+#define BLAKE2B_ZCASH4_OWN
+#include "../blake2b-sse/blake2b.c"
+#undef ROUND
+
+#include <immintrin.h>
+
+static const uint8_t		blake2b_sigma[12][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+	{11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+	{7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+	{9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+	{2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+	{12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+	{13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+	{6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+	{10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}
+};
+
+#define ADD(a,b)	_mm256_add_epi64 ((a), (b))
+#define XOR(a,b)	_mm256_xor_si256 ((a), (b))
+#define ROTR32(x)	_mm256_shuffle_epi32 ((x), _MM_SHUFFLE (2, 3, 0, 1))
+#define ROTR24(x)	_mm256_shuffle_epi8 ((x), r24)
+#define ROTR16(x)	_mm256_shuffle_epi8 ((x), r16)
+#define ROTR63(x)	XOR (_mm256_srli_epi64 ((x), 63), ADD ((x), (x)))
+
+#define G(r,i,a,b,c,d)						\
+	do {							\
+		a = ADD (ADD (a, b), m[blake2b_sigma[r][2*i+0]]);	\
+		d = ROTR32 (XOR (d, a));			\
+		c = ADD (c, d);					\
+		b = ROTR24 (XOR (b, c));			\
+		a = ADD (ADD (a, b), m[blake2b_sigma[r][2*i+1]]);	\
+		d = ROTR16 (XOR (d, a));			\
+		c = ADD (c, d);					\
+		b = ROTR63 (XOR (b, c));			\
+	} while(0)
+
+#define ROUND(r)					\
+	do {						\
+		G (r, 0, v[ 0], v[ 4], v[ 8], v[12]);	\
+		G (r, 1, v[ 1], v[ 5], v[ 9], v[13]);	\
+		G (r, 2, v[ 2], v[ 6], v[10], v[14]);	\
+		G (r, 3, v[ 3], v[ 7], v[11], v[15]);	\
+		G (r, 4, v[ 0], v[ 5], v[10], v[15]);	\
+		G (r, 5, v[ 1], v[ 6], v[11], v[12]);	\
+		G (r, 6, v[ 2], v[ 7], v[ 8], v[13]);	\
+		G (r, 7, v[ 3], v[ 4], v[ 9], v[14]);	\
+	} while(0)
+
+/* v = S->h and IV, 4 independent lanes of m */
+static inline __attribute__ ((always_inline)) void
+blake2b_rounds4 (blake2b_state *S, __m256i v[16], const __m256i m[16],
+    uint64_t counter, uint64_t last) {
+	const __m256i	r16 = _mm256_setr_epi8 (
+	    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+	    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const __m256i	r24 = _mm256_setr_epi8 (
+	    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+	    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	int		i;
+
+	for (i = 0; i < 8; i++)
+		v[i] = _mm256_set1_epi64x (S->h[i]);
+	v[8] = _mm256_set1_epi64x (blake2b_IV[0]);
+	v[9] = _mm256_set1_epi64x (blake2b_IV[1]);
+	v[10] = _mm256_set1_epi64x (blake2b_IV[2]);
+	v[11] = _mm256_set1_epi64x (blake2b_IV[3]);
+	v[12] = _mm256_set1_epi64x (blake2b_IV[4] ^ counter);
+	v[13] = _mm256_set1_epi64x (blake2b_IV[5]);
+	v[14] = _mm256_set1_epi64x (blake2b_IV[6] ^ last);
+	v[15] = _mm256_set1_epi64x (blake2b_IV[7]);
+
+	ROUND (0);
+	ROUND (1);
+	ROUND (2);
+	ROUND (3);
+	ROUND (4);
+	ROUND (5);
+	ROUND (6);
+	ROUND (7);
+	ROUND (8);
+	ROUND (9);
+	ROUND (10);
+	ROUND (11);
+
+	for (i = 0; i < 8; i++)
+		v[i] = XOR (XOR (_mm256_set1_epi64x (S->h[i]), v[i]), v[i + 8]);
+}
+
+#undef G
+#undef ROUND
+
+void
+blake2b_zcash4 (blake2b_state *S, uint32_t w3, uint8_t *out) {
+	__m256i		m[16], v[16], t0, t1, t2, t3;
+	int		i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = _mm256_setzero_si256 ();
+	m[1] = _mm256_slli_epi64 (_mm256_add_epi64 (
+	    _mm256_set1_epi64x (w3), _mm256_setr_epi64x (0, 1, 2, 3)), 32);
+
+	blake2b_rounds4 (S, v, m, 144, -1LL);
+
+	/* transpose words 0..3 of 4 lanes into 4 hashes */
+	t0 = _mm256_unpacklo_epi64 (v[0], v[1]);
+	t1 = _mm256_unpackhi_epi64 (v[0], v[1]);
+	t2 = _mm256_unpacklo_epi64 (v[2], v[3]);
+	t3 = _mm256_unpackhi_epi64 (v[2], v[3]);
+#define O(lane)		((__m256i *)(out + (lane) * BLAKE2B_ZCASH_BYTES))
+	_mm256_storeu_si256 (O (0), _mm256_permute2x128_si256 (t0, t2, 0x20));
+	_mm256_storeu_si256 (O (1), _mm256_permute2x128_si256 (t1, t3, 0x20));
+	_mm256_storeu_si256 (O (2), _mm256_permute2x128_si256 (t0, t2, 0x31));
+	_mm256_storeu_si256 (O (3), _mm256_permute2x128_si256 (t1, t3, 0x31));
+#undef O
+
+	/* words 4, 5 and 2 bytes of word 6 */
+	t0 = _mm256_unpacklo_epi64 (v[4], v[5]);
+	t1 = _mm256_unpackhi_epi64 (v[4], v[5]);
+#define O(lane)		((__m128i *)(out + (lane) * BLAKE2B_ZCASH_BYTES + 32))
+	_mm_storeu_si128 (O (0), _mm256_castsi256_si128 (t0));
+	_mm_storeu_si128 (O (1), _mm256_castsi256_si128 (t1));
+	_mm_storeu_si128 (O (2), _mm256_extracti128_si256 (t0, 1));
+	_mm_storeu_si128 (O (3), _mm256_extracti128_si256 (t1, 1));
+#undef O
+#define O(lane)		(out + (lane) * BLAKE2B_ZCASH_BYTES + 48)
+	*(uint16_t *)O (0) = _mm256_extract_epi64 (v[6], 0);
+	*(uint16_t *)O (1) = _mm256_extract_epi64 (v[6], 1);
+	*(uint16_t *)O (2) = _mm256_extract_epi64 (v[6], 2);
+	*(uint16_t *)O (3) = _mm256_extract_epi64 (v[6], 3);
+#undef O
+}
+
+char *
+blake2b_info (void) {
+	return "avx2";
+}
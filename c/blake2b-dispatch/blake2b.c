@@ -0,0 +1,128 @@
+/*
+ * runtime selection of BLAKE2b backend, all of them are compiled
+ * in with their own instruction set flags.  the first one in the
+ * table (newest instruction set first) that cpu supports and that
+ * gives the same hashes as the reference implementation is used
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "variants.h"
+
+/* by rank, reference is last and is always supported */
+static variant_t	variants[] = {
+	VARIANT (avx2),
+	VARIANT (sse41),
+	VARIANT (sse2),
+	VARIANT (ref),
+};
+
+#define VARIANTS	((int)(sizeof (variants) / sizeof (variants[0])))
+#define CHECK_HASHES	8
+#define CHECK_BYTES	((1 + 2 * CHECK_HASHES) * BLAKE2B_ZCASH_BYTES)
+
+static variant_t	*variant = &variants[VARIANTS - 1];
+static char		info[256];
+
+/* dummy header, zcash hashes take the state after its first block */
+static void
+test_state (variant_t *v, blake2b_state *S) {
+	blake2b_param	P;
+	uint8_t		header[140];
+	int		i;
+
+	memset (&P, 0, sizeof (P));
+	memcpy (P.personal, "ZcashPoW", 8);
+	P.personal[8] = 200;
+	P.personal[12] = 9;
+	P.digest_length = BLAKE2B_ZCASH_BYTES;
+	P.fanout = 1;
+	P.depth = 1;
+	for (i = 0; i < (int)sizeof (header); i++)
+		header[i] = i * 7 + 1;
+
+	v->init_param (S, &P);
+	v->update (S, header, sizeof (header));
+}
+
+/* plain hash of a dummy header, then its zcash hashes one by one and by 4 */
+static void
+self_hash (variant_t *v, uint8_t *out) {
+	blake2b_state	S, F;
+	int		i;
+
+	test_state (v, &S);
+	F = S;
+	v->final (&F, out, BLAKE2B_ZCASH_BYTES);
+	out += BLAKE2B_ZCASH_BYTES;
+	for (i = 0; i < CHECK_HASHES; i++)
+		v->zcash (&S, i, out + i * BLAKE2B_ZCASH_BYTES);
+	out += CHECK_HASHES * BLAKE2B_ZCASH_BYTES;
+	for (i = 0; i < CHECK_HASHES; i += 4)
+		v->zcash4 (&S, i, out + i * BLAKE2B_ZCASH_BYTES);
+}
+
+static int
+self_check (variant_t *v) {
+	uint8_t		ref[CHECK_BYTES], out[CHECK_BYTES];
+
+	self_hash (&variants[VARIANTS - 1], ref);
+	self_hash (v, out);
+	return !memcmp (ref, out, sizeof (ref));
+}
+
+static void __attribute__ ((constructor))
+blake2b_select (void) {
+	int		i, n;
+
+	__builtin_cpu_init ();
+	variants[0].supported = __builtin_cpu_supports ("avx2");
+	variants[1].supported = __builtin_cpu_supports ("sse4.1");
+	variants[2].supported = __builtin_cpu_supports ("sse2");
+	variants[3].supported = 1;
+
+	n = snprintf (info, sizeof (info), "dispatch");
+	for (i = VARIANTS - 1; i >= 0; i--) {
+		if (!variants[i].supported)
+			continue;
+		if (!self_check (&variants[i])) {
+			variants[i].supported = 0;
+			n += snprintf (info + n, sizeof (info) - n,
+			    ", %s failed self-check", variants[i].name);
+			continue;
+		}
+		variant = &variants[i];
+	}
+	snprintf (info + n, sizeof (info) - n, ", using %s", variant->name);
+}
+
+int
+blake2b_init_param (blake2b_state *S, const blake2b_param *P) {
+	return variant->init_param (S, P);
+}
+
+int
+blake2b_update (blake2b_state *S, const uint8_t *in, uint16_t inlen) {
+	return variant->update (S, in, inlen);
+}
+
+int
+blake2b_final (blake2b_state *S, uint8_t *out, uint8_t outlen) {
+	return variant->final (S, out, outlen);
+}
+
+void
+blake2b_zcash (blake2b_state *S, uint32_t w3, uint8_t *out) {
+	variant->zcash (S, w3, out);
+}
+
+void
+blake2b_zcash4 (blake2b_state *S, uint32_t w3, uint8_t *out) {
+	variant->zcash4 (S, w3, out);
+}
+
+char *
+blake2b_info (void) {
+	return info;
+}
@@ -0,0 +1,42 @@
+#ifndef BLAKE2B_VARIANTS_H
+#define BLAKE2B_VARIANTS_H
+
+/*
+ * x86 BLAKE2b backends compiled in side by side (see blake2b.h), for
+ * the dispatcher and bench-hash
+ */
+
+#include "blake2b.h"
+
+#define DECLARE(v) \
+int	BLAKE2B_FN (v, init_param) (blake2b_state *S, const blake2b_param *P); \
+int	BLAKE2B_FN (v, update) (blake2b_state *S, const uint8_t *in, \
+	    uint16_t inlen); \
+int	BLAKE2B_FN (v, final) (blake2b_state *S, uint8_t *out, \
+	    uint8_t outlen); \
+void	BLAKE2B_FN (v, zcash) (blake2b_state *S, uint32_t w3, uint8_t *out); \
+void	BLAKE2B_FN (v, zcash4) (blake2b_state *S, uint32_t w3, uint8_t *out);
+
+DECLARE (ref)
+DECLARE (sse2)
+DECLARE (sse41)
+DECLARE (avx2)
+
+typedef struct {
+	char		*name;
+	int		supported;
+	int		(*init_param) (blake2b_state *S, const blake2b_param *P);
+	int		(*update) (blake2b_state *S, const uint8_t *in,
+			    uint16_t inlen);
+	int		(*final) (blake2b_state *S, uint8_t *out,
+			    uint8_t outlen);
+	void		(*zcash) (blake2b_state *S, uint32_t w3, uint8_t *out);
+	void		(*zcash4) (blake2b_state *S, uint32_t w3,
+			    uint8_t *out);
+} variant_t;
+
+#define VARIANT(v) { #v, 0, \
+	BLAKE2B_FN (v, init_param), BLAKE2B_FN (v, update), \
+	BLAKE2B_FN (v, final), BLAKE2B_FN (v, zcash), BLAKE2B_FN (v, zcash4) }
+
+#endif
@@ -226,6 +226,14 @@ blake2b_final (blake2b_state *S, uint8_t *out, uint8_t outlen) {
 	return 0;
 }
 
+void
+blake2b_zcash4 (blake2b_state *S, uint32_t w3, uint8_t *out) {
+	int		i;
+
+	for (i = 0; i < 4; i++)
+		blake2b_zcash (S, w3 + i, out + i * BLAKE2B_ZCASH_BYTES);
+}
+
 char *
 blake2b_info (void) {
 	return "reference";
@@ -20,6 +20,7 @@
 #define BLAKE2B_KEYBYTES	64
 #define BLAKE2B_SALTBYTES	16
 #define BLAKE2B_PERSONALBYTES	16
+#define BLAKE2B_ZCASH_BYTES	50
 
 #pragma pack(push, 1)
 
@@ -51,11 +52,30 @@ typedef struct __blake2b_state {
 /* Padded structs result in a compile-time error */
 typedef char blake2b_dummy_t[1 / (sizeof (blake2b_param) == BLAKE2B_OUTBYTES)];
 
+/*
+ * with runtime dispatch (BLAKE = dispatch in Makefile) every backend
+ * is compiled with -DBLAKE2B_VARIANT=name and its functions become
+ * blake2b_name_update and so on, blake2b-dispatch picks one at startup
+ */
+#define BLAKE2B_FN(v,f)		blake2b_##v##_##f
+#define BLAKE2B_FN_(v,f)	BLAKE2B_FN (v, f)
+
+#ifdef BLAKE2B_VARIANT
+#define blake2b_init_param	BLAKE2B_FN_ (BLAKE2B_VARIANT, init_param)
+#define blake2b_update		BLAKE2B_FN_ (BLAKE2B_VARIANT, update)
+#define blake2b_final		BLAKE2B_FN_ (BLAKE2B_VARIANT, final)
+#define blake2b_zcash		BLAKE2B_FN_ (BLAKE2B_VARIANT, zcash)
+#define blake2b_zcash4		BLAKE2B_FN_ (BLAKE2B_VARIANT, zcash4)
+#define blake2b_info		BLAKE2B_FN_ (BLAKE2B_VARIANT, info)
+#endif
+
 /* Streaming API */
 int	blake2b_init_param (blake2b_state *S, const blake2b_param *P);
 int	blake2b_update (blake2b_state *S, const uint8_t *in, uint16_t inlen);
 int	blake2b_final (blake2b_state *S, uint8_t *out, uint8_t outlen);
 void 	blake2b_zcash (blake2b_state *S, uint32_t w3, uint8_t *out);
+/* hashes w3 .. w3 + 3 to out, BLAKE2B_ZCASH_BYTES each */
+void 	blake2b_zcash4 (blake2b_state *S, uint32_t w3, uint8_t *out);
 char	*blake2b_info (void);
 
 #endif
@@ -0,0 +1,207 @@
+/*
+ * runtime selection of equihash parameters, the solver is compiled
+ * in once for every (n,k) with its table layout derived at compile
+ * time, equihash_new picks the one asked for
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "equihash.h"
+
+#define DECLARE(v) \
+typedef struct EQUIHASH_FN (v, ctx)	EQUIHASH_FN (v, ctx); \
+typedef int	(*EQUIHASH_FN (v, solution_t)) (EQUIHASH_FN (v, ctx) *ctx, \
+		    block_t *block, void *arg); \
+typedef int	(*EQUIHASH_FN (v, cancel_t)) (EQUIHASH_FN (v, ctx) *ctx, \
+		    void *arg); \
+EQUIHASH_FN (v, ctx)	*EQUIHASH_FN (v, new) (int n, int k, int threads, \
+			    EQUIHASH_FN (v, solution_t) solution, void *arg); \
+void	EQUIHASH_FN (v, free) (EQUIHASH_FN (v, ctx) *ctx); \
+void	EQUIHASH_FN (v, set_cancel) (EQUIHASH_FN (v, ctx) *ctx, \
+	    EQUIHASH_FN (v, cancel_t) cancel); \
+char	*EQUIHASH_FN (v, info) (EQUIHASH_FN (v, ctx) *ctx); \
+void	EQUIHASH_FN (v, step0) (EQUIHASH_FN (v, ctx) *ctx, block_t *block); \
+void	EQUIHASH_FN (v, step0_next) (EQUIHASH_FN (v, ctx) *ctx, \
+	    block_t *block); \
+void	EQUIHASH_FN (v, step) (EQUIHASH_FN (v, ctx) *ctx, int step); \
+void	EQUIHASH_FN (v, step_pair) (EQUIHASH_FN (v, ctx) *a, \
+	    EQUIHASH_FN (v, ctx) *b, int step); \
+int	EQUIHASH_FN (v, steps) (EQUIHASH_FN (v, ctx) *ctx); \
+int	EQUIHASH_FN (v, block_bytes) (EQUIHASH_FN (v, ctx) *ctx); \
+\
+static int \
+EQUIHASH_FN (v, glue_solution) (EQUIHASH_FN (v, ctx) *v_ctx, block_t *block, \
+    void *arg) { \
+	equihash_ctx	*ctx = arg; \
+	\
+	(void)v_ctx; \
+	return ctx->solution (ctx, block, ctx->arg); \
+} \
+static int \
+EQUIHASH_FN (v, glue_cancel) (EQUIHASH_FN (v, ctx) *v_ctx, void *arg) { \
+	equihash_ctx	*ctx = arg; \
+	\
+	(void)v_ctx; \
+	return ctx->cancel (ctx, ctx->arg); \
+} \
+static void * \
+EQUIHASH_FN (v, glue_new) (int n, int k, int threads, equihash_ctx *ctx) { \
+	return EQUIHASH_FN (v, new) (n, k, threads, \
+	    EQUIHASH_FN (v, glue_solution), ctx); \
+} \
+static void \
+EQUIHASH_FN (v, glue_free) (void *v_ctx) { \
+	EQUIHASH_FN (v, free) (v_ctx); \
+} \
+static void \
+EQUIHASH_FN (v, glue_set_cancel) (void *v_ctx, int on) { \
+	EQUIHASH_FN (v, set_cancel) (v_ctx, \
+	    on ? EQUIHASH_FN (v, glue_cancel) : NULL); \
+} \
+static char * \
+EQUIHASH_FN (v, glue_info) (void *v_ctx) { \
+	return EQUIHASH_FN (v, info) (v_ctx); \
+} \
+static void \
+EQUIHASH_FN (v, glue_step0) (void *v_ctx, block_t *block) { \
+	EQUIHASH_FN (v, step0) (v_ctx, block); \
+} \
+static void \
+EQUIHASH_FN (v, glue_step0_next) (void *v_ctx, block_t *block) { \
+	EQUIHASH_FN (v, step0_next) (v_ctx, block); \
+} \
+static void \
+EQUIHASH_FN (v, glue_step) (void *v_ctx, int step) { \
+	EQUIHASH_FN (v, step) (v_ctx, step); \
+} \
+static void \
+EQUIHASH_FN (v, glue_step_pair) (void *a, void *b, int step) { \
+	EQUIHASH_FN (v, step_pair) (a, b, step); \
+} \
+static int \
+EQUIHASH_FN (v, glue_steps) (void *v_ctx) { \
+	return EQUIHASH_FN (v, steps) (v_ctx); \
+} \
+static int \
+EQUIHASH_FN (v, glue_block_bytes) (void *v_ctx) { \
+	return EQUIHASH_FN (v, block_bytes) (v_ctx); \
+}
+
+typedef struct {
+	void		*(*new) (int n, int k, int threads, equihash_ctx *ctx);
+	void		(*free) (void *v_ctx);
+	void		(*set_cancel) (void *v_ctx, int on);
+	char		*(*info) (void *v_ctx);
+	void		(*step0) (void *v_ctx, block_t *block);
+	void		(*step0_next) (void *v_ctx, block_t *block);
+	void		(*step) (void *v_ctx, int step);
+	void		(*step_pair) (void *a, void *b, int step);
+	int		(*steps) (void *v_ctx);
+	int		(*block_bytes) (void *v_ctx);
+} variant_t;
+
+struct equihash_ctx {
+	variant_t		*variant;
+	void			*v_ctx;
+	equihash_solution_t	solution;
+	equihash_cancel_t	cancel;
+	void			*arg;
+};
+
+DECLARE (200_9)
+DECLARE (144_5)
+DECLARE (192_7)
+DECLARE (96_5)
+
+#define VARIANT(v) { \
+	EQUIHASH_FN (v, glue_new), EQUIHASH_FN (v, glue_free), \
+	EQUIHASH_FN (v, glue_set_cancel), EQUIHASH_FN (v, glue_info), \
+	EQUIHASH_FN (v, glue_step0), EQUIHASH_FN (v, glue_step0_next), \
+	EQUIHASH_FN (v, glue_step), EQUIHASH_FN (v, glue_step_pair), \
+	EQUIHASH_FN (v, glue_steps), EQUIHASH_FN (v, glue_block_bytes) }
+
+static variant_t	variants[] = {
+	VARIANT (200_9),
+	VARIANT (144_5),
+	VARIANT (192_7),
+	VARIANT (96_5),
+};
+
+#define VARIANTS	((int)(sizeof (variants) / sizeof (variants[0])))
+
+equihash_ctx *
+equihash_new (int n, int k, int threads, equihash_solution_t solution,
+    void *arg) {
+	equihash_ctx	*ctx;
+	int		i;
+
+	ctx = malloc (sizeof (*ctx));
+	if (!ctx) {
+		printf ("die: no mem for equihash context\n");
+		exit (1);
+	}
+	ctx->solution = solution;
+	ctx->cancel = NULL;
+	ctx->arg = arg;
+	for (i = 0; i < VARIANTS; i++) {
+		ctx->variant = &variants[i];
+		ctx->v_ctx = ctx->variant->new (n, k, threads, ctx);
+		if (ctx->v_ctx)
+			return ctx;
+	}
+	free (ctx);
+	return NULL;
+}
+
+void
+equihash_free (equihash_ctx *ctx) {
+	ctx->variant->free (ctx->v_ctx);
+	free (ctx);
+}
+
+void
+equihash_set_cancel (equihash_ctx *ctx, equihash_cancel_t cancel) {
+	ctx->cancel = cancel;
+	ctx->variant->set_cancel (ctx->v_ctx, cancel != NULL);
+}
+
+char *
+equihash_info (equihash_ctx *ctx) {
+	return ctx->variant->info (ctx->v_ctx);
+}
+
+void
+equihash_step0 (equihash_ctx *ctx, block_t *block) {
+	ctx->variant->step0 (ctx->v_ctx, block);
+}
+
+void
+equihash_step0_next (equihash_ctx *ctx, block_t *block) {
+	ctx->variant->step0_next (ctx->v_ctx, block);
+}
+
+void
+equihash_step (equihash_ctx *ctx, int step) {
+	ctx->variant->step (ctx->v_ctx, step);
+}
+
+void
+equihash_step_pair (equihash_ctx *a, equihash_ctx *b, int step) {
+	if (a->variant == b->variant) {
+		a->variant->step_pair (a->v_ctx, b->v_ctx, step);
+	} else {
+		equihash_step (a, step);
+		equihash_step (b, step);
+	}
+}
+
+int
+equihash_steps (equihash_ctx *ctx) {
+	return ctx->variant->steps (ctx->v_ctx);
+}
+
+int
+equihash_block_bytes (equihash_ctx *ctx) {
+	return ctx->variant->block_bytes (ctx->v_ctx);
+}
@@ -2,12 +2,116 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if WC_STREAM || SLOT_PAD
+#include <immintrin.h>
+#endif
 
 #include "blake2b.h"
 #include "equihash.h"
 
 #define DEBUG			0
 
+/*
+ * DENSE keeps every step in one array of slots sized by a counting
+ * pass instead of L1_BOXES buckets of L2_STRINGS slots.  the counting
+ * pass keeps the tree words of its pairs, the placing pass only xors
+ * and stores them.  for 200,9 180 MB instead of 235 MB for ~30% more
+ * time (the table is read twice), so it is off by default
+ */
+#ifndef DENSE
+#define DENSE			0
+#endif
+
+/*
+ * appends to a random box go first to a small per thread per box
+ * staging area and are copied out WC_SLOTS slots at once, so the
+ * scatter writes whole lines instead of touching a page per string.
+ * WC_STREAM copies with non-temporal stores (SSE2 only).  off by
+ * default, it was ~20% slower than direct writes on a small VM
+ */
+#ifndef WC_SLOTS
+#define WC_SLOTS		0
+#endif
+#ifndef WC_STREAM
+#define WC_STREAM		0
+#endif
+
+/*
+ * SLOT_PAD pads slots to 8 words, so a slot never straddles a cache
+ * line, and genstep xors payloads with SSE2/AVX2 (if compiled for it)
+ */
+#ifndef SLOT_PAD
+#define SLOT_PAD		0
+#endif
+
+/*
+ * genstep prefetches the slot PREFETCH strings ahead of the one being
+ * paired, and the first PREFETCH strings of the next box.  boxes are
+ * read in order and the hardware prefetcher mostly keeps up, so it
+ * is off by default
+ */
+#ifndef PREFETCH
+#define PREFETCH		0
+#endif
+
+/*
+ * from step DUPE_STEP pairs whose parents share a child are dropped
+ * in genstep, such a tree repeats leaves and tree_restore rejects it.
+ * earlier steps have next to none of them
+ */
+#ifndef DUPE_STEP
+#define DUPE_STEP		(WK - 1)
+#endif
+
+/*
+ * the last IDX_STEPS steps before WK store only the tree word, genstep
+ * of the next step gets the payload of a box back from the parents,
+ * down to the last step that stored it.  less written for some more
+ * read, off by default.  the tree words written must stay clear of
+ * the last stored payload, 200,9 allows 1, or 2 with SLOT_PAD
+ */
+#ifndef IDX_STEPS
+#define IDX_STEPS		0
+#endif
+#define IDX_STEP		(WK - IDX_STEPS)
+
+/*
+ * PACK_LAST writes step WK - 1 to an array of its own, payload and
+ * tree word back to back, instead of into slots of SLOT_WORDS, so
+ * steps WK - 1 and WK touch ~3x fewer lines.  ~25% faster steps 8
+ * and 9 of 200,9 for 30 MB more
+ */
+#ifndef PACK_LAST
+#define PACK_LAST		1
+#endif
+#if PACK_LAST && IDX_STEPS
+#error "PACK_LAST keeps the payload of step k - 1, IDX_STEPS does not"
+#endif
+
+/*
+ * PIPELINE keeps a third table, equihash_step0_next hashes the next
+ * header into it on a thread of its own while the late steps of this
+ * one run, and step0 of that header then only swaps it in.  a spare
+ * core (or hyperthread) per solver makes step0 ~free, 100 MB more
+ */
+#ifndef PIPELINE
+#define PIPELINE		0
+#endif
+#if PIPELINE && (DENSE || WC_SLOTS)
+#error "PIPELINE step0 writes its table directly, no DENSE or WC_SLOTS"
+#endif
+
+/*
+ * genstep asks the cancel callback every CANCEL_BOXES boxes (on its
+ * first thread), a cancelled solve stops there and its steps left
+ * return at once.  4096 boxes a step for 200,9
+ */
+#ifndef CANCEL_BOXES
+#define CANCEL_BOXES		256
+#endif
+
 typedef uint32_t		word_t;
 
 #define STRING_IDX_BITS		(WN / (WK + 1) + 1)
@@ -18,7 +122,7 @@ typedef uint32_t		word_t;
 #define BYTE_BITS		(8)
 #define WORD_BYTES		((int)sizeof (word_t))
 #define WORD_BITS		(WORD_BYTES * BYTE_BITS)
-#define DIV_UP(x,r)		((x + r - 1) / r)
+#define DIV_UP(x,r)		(((x) + (r) - 1) / (r))
 
 #define STRING_BITS		(WN)
 #define STRING_BYTES		(STRING_BITS / BYTE_BITS)
@@ -26,22 +130,33 @@ typedef uint32_t		word_t;
 #define STRING_ALIGN_BITS	(STRING_WORDS * WORD_BITS - STRING_BITS)
 #define STRING_ALIGN_BYTES	(STRING_ALIGN_BITS / BYTE_BITS)
 
-#define L2_BITS			(8)
-#define L1_BITS			(STEP_BITS - L2_BITS)
+/*
+ * a tree word holds L1 box and two slot indexes of L2Z_BITS, boxes of
+ * 2^(STRING_IDX_BITS - L1_BITS) * 7/4 slots need L2Z_BITS one more.
+ * 8 bits of L2 if it fits, else the smallest L1 that fits in a word.
+ * the boxes of that one average a few dozen strings and vary more,
+ * they get all the slots L2Z_BITS can index
+ */
+#define L1_BITS_MIN		(STRING_IDX_BITS * 2 + 2 - WORD_BITS)
+#define L1_BITS			(STEP_BITS - 8 > L1_BITS_MIN ? \
+				    STEP_BITS - 8 : L1_BITS_MIN)
+#define L2_BITS			(STEP_BITS - L1_BITS)
 #define L3_STRINGS		16
 #define L1_BOXES		(1 << L1_BITS)
 #define L2_BOXES		(1 << L2_BITS)
-#define L2_STRINGS		(STRINGS / L1_BOXES * 7 / 4)
+#define L2_STRINGS		(L1_BITS > STEP_BITS - 8 ? L2Z_MASK + 1 : \
+				    STRINGS / L1_BOXES * 7 / 4)
 #define L1_MASK			(L1_BOXES - 1)
 #define L2_MASK			(L2_BOXES - 1)
 #define L12_MASK		((1 << STEP_BITS) - 1)
 #define L212_MASK		((1 << (STEP_BITS + L2_BITS)) - 1)
 
-#define L2Z_BITS		(L2_BITS + 2)
+#define L2Z_BITS		(STRING_IDX_BITS - L1_BITS + 1)
 #define L2Z_MASK		((1 << L2Z_BITS) - 1)
 #define TREE_BITS		(L1_BITS + L2Z_BITS * 2)
 #define TREE_WORDS		DIV_UP (TREE_BITS, WORD_BITS)
-#define TREE(i1,i2a,i2b)	(((i1) << (L2Z_BITS * 2)) | ((i2a) << L2Z_BITS) | (i2b))
+#define TREE(i1,i2a,i2b)	((word_t)(i1) << (L2Z_BITS * 2) | \
+				    (word_t)(i2a) << L2Z_BITS | (word_t)(i2b))
 #define TREE_L1(tree)		((tree) >> (L2Z_BITS * 2))
 #define TREE_L2A(tree)		(((tree) >> L2Z_BITS) & L2Z_MASK)
 #define TREE_L2B(tree)		((tree) & L2Z_MASK)
@@ -50,7 +165,21 @@ typedef uint32_t		word_t;
 #define MEM_WORDS(step)		(DIV_UP (MEM_BITS (step), WORD_BITS))
 #define MEM_WORDS1		MEM_WORDS (1)
 #define MEM_DECR0		(STRING_WORDS + TREE_WORDS - MEM_WORDS1)
-#define TREE_POS(step)		(MEM_WORDS1 - 1 - ((step) >> 1))
+#define SLOT_WORDS		(SLOT_PAD ? 8 : MEM_WORDS1)
+#define TREE_POS(step)		(SLOT_WORDS - 1 - ((step) >> 1))
+
+/* packed step WK - 1 string, its tree word is last */
+#define PACK_WORDS		MEM_WORDS (WK)
+#define PACKED(step)		(PACK_LAST && (step) == WK - 1)
+#define TREE_AT(step)		(PACKED (step) ? PACK_WORDS - 1 : TREE_POS (step))
+
+/* words of payload genstep writes, index-only steps have none */
+#define LAZY(step)		((step) >= IDX_STEP && (step) < WK)
+#define PAYLOAD_WORDS(step)	(LAZY (step) ? 0 : MEM_WORDS ((step) + 1) - 1)
+/* last step, of the same parity, that writes over the last payload */
+#define LAZY_LAST		(WK - 1 - ((WK - IDX_STEP) & 1))
+typedef char lazy_dummy_t[1 / (IDX_STEP >= 2 && (LAZY_LAST < IDX_STEP + 1 ||
+			    TREE_POS (LAZY_LAST) >= MEM_WORDS (IDX_STEP) - 1))];
 
 #define BIT_IDX(x)		(WORD_BITS - 1 - (x) % WORD_BITS)
 #define L2_FIRST_BIT(step)	BIT_IDX (STRING_ALIGN_BITS + (step    ) * STEP_BITS - L2_BITS)
@@ -58,12 +187,72 @@ typedef uint32_t		word_t;
 
 #define HASH_STRINGS		(BLAKE2B_OUTBYTES / STRING_BYTES)
 #define HASH_BYTES		(HASH_STRINGS * STRING_BYTES)
-#define HASHES			(STRINGS / HASH_STRINGS)
+/* by 4 for blake2b_zcash4, strings past STRINGS are not used */
+#define HASHES			(DIV_UP (STRINGS, HASH_STRINGS * 4) * 4)
+/* blake2b_zcash gives only the first BLAKE2B_ZCASH_BYTES */
+#define HASH_ZCASH		(HASH_BYTES <= BLAKE2B_ZCASH_BYTES)
+#define HASH_STRIDE		(HASH_ZCASH ? BLAKE2B_ZCASH_BYTES : HASH_BYTES)
+
+#define SOLUTION_BYTES		DIV_UP (SOLUTION_NUMS * STRING_IDX_BITS, \
+				    BYTE_BITS)
+/* compact size in front of the solution */
+#define SOLSIZE_BYTES		(SOLUTION_BYTES < 0xfd ? 1 : 3)
 
 #define L12L2Z(i12,i2)		((i12) << L2Z_BITS | (i2))
 #define L12L2Z_L2Z(pack)	((pack) & L2Z_MASK)
 #define L12L2Z_L12(pack)	((pack) >> L2Z_BITS)
 
+/*
+ * with -t N every step is split among N threads by L1 boxes, each
+ * thread appends to its own sub-bucket of a box, as many slots as it
+ * gets strings on average, so mostly no locks are needed.  the rest
+ * of the box is shared, strings past a full sub-bucket go there with
+ * an atomic add, and are dropped only when it is full too
+ */
+#define THREADS_MAX		16
+
+/*
+ * the context with its tables is mmaped, on MAP_HUGETLB pages if the
+ * system has them reserved, else on 2 MB aligned memory madvised for
+ * transparent huge pages.  equihash_new starts a thread touching the
+ * tables, step0 waits for it
+ */
+#define HUGE_BYTES		(2 << 20)
+#define PAGE_BYTES		4096
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS		MAP_ANON
+#endif
+
+#define CACHE_LINE_WORDS	(64 / WORD_BYTES)
+#define WC_WORDS		(DIV_UP (WC_SLOTS * SLOT_WORDS, \
+				    CACHE_LINE_WORDS) * CACHE_LINE_WORDS)
+
+/* box fill histogram, in 1/FILL_BINS of L2_STRINGS, last is full */
+#define FILL_BINS		8
+/* solutions per run of an ideal solver, known for 200,9 only */
+#if WN == 200 && WK == 9
+#define SOLS_IDEAL		1.88
+#endif
+/* sols/run of the last ~1/SOLS_ALPHA runs */
+#define SOLS_ALPHA		0.05
+/*
+ * step WK full collisions kept per thread, a few are usual.  without
+ * the DUPE_STEP pruning there are thousands, those past CANDS_MAX are
+ * checked right away
+ */
+#define CANDS_MAX		64
+
+/* step outputs are 2^21 +- 20% strings, more are dropped */
+#define DENSE_STRINGS		(STRINGS / 4 * 5)
+
+#if PREFETCH && defined (__GNUC__)
+/* slot is not a line, touch both ends */
+#define PREFETCH_SLOT(p)	(__builtin_prefetch (p), \
+				    __builtin_prefetch ((p) + SLOT_WORDS - 1))
+#else
+#define PREFETCH_SLOT(p)	((void)0)
+#endif
+
 #if DEBUG
 #define IF_DEBUG(x)		(x)
 #define ASSERT(x)						\
@@ -79,19 +268,127 @@ typedef uint32_t		word_t;
 #define ASSERT(x)		((void)0)
 #endif
 
+#if DENSE
+/*
+ * box i1 of step s is slots base[s][i1] .. base[s][i1 + 1] - 1,
+ * thread t wrote cap[t][i1] of them starting from sub[t][i1]
+ */
 typedef struct {
-	int		cnt[L1_BOXES];
-	word_t		mem[L1_BOXES][L2_STRINGS][MEM_WORDS1];
+	int		cnt[THREADS_MAX][L1_BOXES];
+	int		cap[THREADS_MAX][L1_BOXES];
+	int		sub[THREADS_MAX][L1_BOXES];
+	word_t		spill[THREADS_MAX][SLOT_WORDS];
+	ALIGN (64) word_t	mem[DENSE_STRINGS][SLOT_WORDS];
 } l1_t;
 
-static block_t		*pblock;
-static l1_t		l1x, l1y;
+#define SLOT(ctx,l1,step,i1,i2)	((l1)->mem[(ctx)->base[step][i1] + (i2)])
+#define SUB(ctx,l1,t,i1)	((l1)->sub[t][i1])
+#define CAP(ctx,l1,t,i1)	((l1)->cap[t][i1])
+#define PARTS(ctx)		((ctx)->threads)
+#else
+/* part t < threads of a box is thread t's, part threads is shared */
+typedef struct {
+	int		cnt[THREADS_MAX + 1][L1_BOXES];
+	word_t		spill[THREADS_MAX][SLOT_WORDS];
+	ALIGN (64) word_t	mem[L1_BOXES][L2_STRINGS][SLOT_WORDS];
+} l1_t;
 
-#define L1(step)		((step) & 1 ? &l1y : &l1x)
+#define SLOT(ctx,l1,step,i1,i2)	((l1)->mem[i1][i2])
+#define SUB(ctx,l1,t,i1)	((t) * (ctx)->l1_cap)
+#define CAP(ctx,l1,t,i1)	((t) < (ctx)->threads ? (ctx)->l1_cap : \
+				    L2_STRINGS - (t) * (ctx)->l1_cap)
+#define PARTS(ctx)		((ctx)->threads + 1)
+#endif
 
+typedef struct {
+	equihash_ctx	*ctx;
+	int		thread;
+} thread_arg_t;
+
+/* health counters, every thread has its own line */
+typedef struct {
+	long		dropped[WK];	/* strings past a full box, by step */
+	long		l3_dropped[WK + 1];	/* strings past a full l3 */
+	long		rejected;	/* step WK pairs tree_restore rejected */
+	long		cands_inline;	/* step WK pairs past CANDS_MAX */
+	char		pad[64];
+} stat_t;
+
+struct equihash_ctx {
+	size_t			size;	/* mmaped */
+	char			*pages;	/* what kind of */
+	pthread_t		prefault;
+	int			prefaulting;
+	block_t			*block;
+	blake2b_state		state;
+	int			threads;
+	int			l1_cap;
+	volatile int		stop;
+	pthread_mutex_t		sol_mutex;
+	equihash_solution_t	solution;
+	equihash_cancel_t	cancel;
+	void			*arg;
+	thread_arg_t		thread_arg[THREADS_MAX];
+	stat_t			stat[THREADS_MAX];
+	long			runs;	/* solves that got to the end */
+	long			cancels;	/* solves the callback stopped */
+	long			sols;	/* solutions of those */
+	long			run_sols;
+	double			sols_avg;	/* moving, by SOLS_ALPHA */
+	long			fill[WK][FILL_BINS + 1];
+#if IDX_STEPS
+	word_t			lazy[THREADS_MAX][L2Z_MASK + 1][SLOT_WORDS];
+#endif
+	int			cands[THREADS_MAX];
+	word_t			cand[THREADS_MAX][CANDS_MAX];
+#if DENSE
+	int			counting;
+	int			base[WK][L1_BOXES];
+	int			npairs[THREADS_MAX];
+	word_t			pairs[DENSE_STRINGS];	/* trees, by thread */
+#endif
+#if WC_SLOTS
+	word_t			*wc;	/* [threads][L1_BOXES][WC_WORDS] */
+#endif
+#if PIPELINE
+	l1_t			*tab[2];
+	l1_t			*next_l1;
+	blake2b_state		next_state;
+	uint8_t			next_header[offsetof (block_t, solsize)];
+	pthread_t		next_tid;
+	int			next_running;
+	int			next_ready;	/* next_header is hashed */
+#endif
+	l1_t			l1x, l1y;	/* tables from here on */
+#if PIPELINE
+	l1_t			l1z;
+#endif
+#if PACK_LAST && DENSE
+	word_t			last[DENSE_STRINGS][PACK_WORDS];
+#elif PACK_LAST
+	word_t			last[L1_BOXES][L2_STRINGS][PACK_WORDS];
+#endif
 #if DEBUG
-static word_t		orig[STRINGS][STRING_WORDS];
+	word_t			orig[STRINGS][STRING_WORDS];
+#endif
+};
+
+#if PIPELINE
+#define L1(ctx,step)		((ctx)->tab[(step) & 1])
+#else
+#define L1(ctx,step)		((step) & 1 ? &(ctx)->l1y : &(ctx)->l1x)
+#endif
+
+/* string i2 of box i1 of a step, packed or in a slot */
+#if PACK_LAST && DENSE
+#define PSLOT(ctx,i1,i2)	((ctx)->last[(ctx)->base[WK - 1][i1] + (i2)])
+#elif PACK_LAST
+#define PSLOT(ctx,i1,i2)	((ctx)->last[i1][i2])
+#else
+#define PSLOT(ctx,i1,i2)	SLOT (ctx, L1 (ctx, WK - 1), WK - 1, i1, i2)
 #endif
+#define STR(ctx,l1,step,i1,i2)	(PACKED (step) ? PSLOT (ctx, i1, i2) : \
+				    SLOT (ctx, l1, step, i1, i2))
 
 static void
 die (char *str) {
@@ -100,19 +397,158 @@ die (char *str) {
 }
 
 static void
-l1_init (l1_t *l1) {
-	memset (l1->cnt, 0, sizeof (l1->cnt));
+l1_init (equihash_ctx *ctx, l1_t *l1) {
+	memset (l1->cnt, 0, sizeof (l1->cnt[0]) * PARTS (ctx));
+}
+
+#if WC_SLOTS
+#define WC(ctx,thread,i1)	((ctx)->wc + \
+				    ((thread) * L1_BOXES + (i1)) * WC_WORDS)
+#if WC_STREAM
+#define WC_STORE(p,x)		_mm_stream_si32 ((int *)(p), (x))
+#else
+#define WC_STORE(p,x)		(*(p) = (x))
+#endif
+
+/*
+ * copy out n staged slots, the last of them is slot i2 of the box.
+ * only payload and tree word of this step, the rest of the slot
+ * keeps tree words of earlier steps
+ */
+static void
+wc_flush (equihash_ctx *ctx, l1_t *l1, int step, int thread, word_t i1,
+    int i2, int n) {
+	word_t		*src = WC (ctx, thread, i1),
+			*dst = SLOT (ctx, l1, step, i1,
+			    SUB (ctx, l1, thread, i1) + i2 + 1 - n);
+	int		i, j, words = PAYLOAD_WORDS (step);
+
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < words; i++)
+			WC_STORE (dst + i, src[i]);
+		WC_STORE (dst + TREE_POS (step), src[TREE_POS (step)]);
+		src += SLOT_WORDS;
+		dst += SLOT_WORDS;
+	}
+}
+
+/* called by every writer thread when it is done with the step */
+static void
+l1_flush (equihash_ctx *ctx, l1_t *l1, int step, int thread) {
+	int		i1, n;
+
+	if (PACKED (step))
+		return;
+	for (i1 = 0; i1 < L1_BOXES; i1++) {
+		n = l1->cnt[thread][i1];
+		if (n)
+			wc_flush (ctx, l1, step, thread, i1, n - 1,
+			    (n - 1) % WC_SLOTS + 1);
+	}
+#if WC_STREAM
+	_mm_sfence ();
+#endif
 }
+#else
+#define l1_flush(ctx,l1,step,thread)	((void)0)
+#endif
 
 static word_t *
-l1_addr (l1_t *l1, word_t i1) {
+l1_addr (equihash_ctx *ctx, l1_t *l1, int step, int thread, word_t i1) {
 	int		i2;
+#if !DENSE
+	int		t = ctx->threads;
+#endif
 
+	(void)step;
 	ASSERT (i1 < L1_BOXES);
-	i2 = l1->cnt[i1]++;
-	if (DEBUG && i2 >= L2_STRINGS - 1)
-		die ("no mem");
-	return l1->mem[i1][i2];
+	i2 = l1->cnt[thread][i1];
+	if (i2 >= CAP (ctx, l1, thread, i1)) {
+#if !DENSE
+		/* written directly, staging is for the thread's own part */
+		i2 = __sync_fetch_and_add (&l1->cnt[t][i1], 1);
+		if (i2 < CAP (ctx, l1, t, i1))
+			return STR (ctx, l1, step, i1,
+			    SUB (ctx, l1, t, i1) + i2);
+		__sync_fetch_and_sub (&l1->cnt[t][i1], 1);
+#endif
+		if (DEBUG)
+			die ("no mem");
+		ctx->stat[thread].dropped[step]++;
+		return l1->spill[thread];	/* dropped */
+	}
+	l1->cnt[thread][i1] = i2 + 1;
+#if WC_SLOTS
+	if (!PACKED (step)) {
+		/* previous slots are written by now */
+		if (i2 && i2 % WC_SLOTS == 0)
+			wc_flush (ctx, l1, step, thread, i1, i2 - 1,
+			    WC_SLOTS);
+		return WC (ctx, thread, i1) + i2 % WC_SLOTS * SLOT_WORDS;
+	}
+#endif
+	return STR (ctx, l1, step, i1, SUB (ctx, l1, thread, i1) + i2);
+}
+
+/* after a step, how full its boxes are */
+static void
+l1_fill (equihash_ctx *ctx, l1_t *l1, int step) {
+	int		i1, t, n;
+
+	for (i1 = 0; i1 < L1_BOXES; i1++) {
+		for (t = 0, n = 0; t < PARTS (ctx); t++)
+			n += l1->cnt[t][i1];
+		n = n * FILL_BINS / L2_STRINGS;
+		ctx->fill[step][n < FILL_BINS ? n : FILL_BINS]++;
+	}
+}
+
+#if DENSE
+/* counts of the counting pass become boxes of the placing pass */
+static void
+dense_layout (equihash_ctx *ctx, l1_t *l1, int step) {
+	int		i1, t, n, box, e = 0;
+
+	for (i1 = 0; i1 < L1_BOXES; i1++) {
+		ctx->base[step][i1] = e;
+		for (t = 0, box = 0; t < ctx->threads; t++) {
+			/* tree has L2Z_BITS for index in box */
+			n = l1->cnt[t][i1];
+			if (n > L2Z_MASK + 1 - box)
+				n = L2Z_MASK + 1 - box;
+			if (n > DENSE_STRINGS - e)
+				n = DENSE_STRINGS - e;
+			l1->sub[t][i1] = box;
+			l1->cap[t][i1] = n;
+			l1->cnt[t][i1] = 0;
+			box += n;
+			e += n;
+		}
+	}
+}
+#endif
+
+static void
+parallel (equihash_ctx *ctx, void (*fn) (equihash_ctx *ctx, int thread),
+    void *(*start) (void *)) {
+	pthread_t	tid[THREADS_MAX];
+	int		t;
+
+	for (t = 1; t < ctx->threads; t++)
+		if (pthread_create (&tid[t], NULL, start, &ctx->thread_arg[t]))
+			die ("pthread_create");
+	fn (ctx, 0);
+	for (t = 1; t < ctx->threads; t++)
+		pthread_join (tid[t], NULL);
+}
+
+#define PARALLEL(fn) \
+static void * \
+fn##_start (void *arg) { \
+	thread_arg_t	*ta = arg; \
+	\
+	fn (ta->ctx, ta->thread); \
+	return NULL; \
 }
 
 static word_t
@@ -133,18 +569,25 @@ l212_val (int step, word_t *ptr) {
 }
 
 static void
-step0_add (int s, uint8_t *str) {
+step0_add (equihash_ctx *ctx, l1_t *l1, int thread, int s, uint8_t *str) {
 	int			i, j, k;
-	word_t			*ptr, x;
+	word_t			*ptr, x, i1;
 
 #if DEBUG
-	orig[s][STRING_WORDS - 1] = 0;
-	memcpy (orig[s], str, STRING_BYTES);
+	ctx->orig[s][STRING_WORDS - 1] = 0;
+	memcpy (ctx->orig[s], str, STRING_BYTES);
 #endif
 	/* everything is LE but bits are BE... f*ck that, BE all */
 
-	ASSERT (L1_BITS <= 16);
-	ptr = l1_addr (L1 (0), ((str[0] << 8) | str[1]) >> (16 - L1_BITS));
+	ASSERT (L1_BITS <= 24);
+	i1 = ((str[0] << 16) | (str[1] << 8) | str[2]) >> (24 - L1_BITS);
+#if DENSE
+	/* unsorted into the other table at s, box in place of tree */
+	ptr = L1 (ctx, 1)->mem[s];
+	l1->cnt[thread][i1]++;
+#else
+	ptr = l1_addr (ctx, l1, 0, thread, i1);
+#endif
 
 	k = MEM_DECR0 * WORD_BYTES - STRING_ALIGN_BYTES;
 	for (i = 0; i < MEM_WORDS1 - 1; i++) {
@@ -155,27 +598,78 @@ step0_add (int s, uint8_t *str) {
 		ptr[i] = x;
 	}
 	ASSERT (k == STRING_BYTES);
-	ptr[TREE_POS (0)] = s;
+	ptr[TREE_POS (0)] = DENSE ? i1 : (word_t)s;
 }
 
-void
-step0 (block_t *p) {
-	int			h, i;
+/* hashes of header state st to table l1, thread's part of them */
+static void
+step0_hash (equihash_ctx *ctx, l1_t *l1, blake2b_state *st, int thread) {
+	int			h, i, l, s,
+				h0 = HASHES / 4 * thread / ctx->threads * 4,
+				h1 = HASHES / 4 * (thread + 1) / ctx->threads * 4;
+	uint8_t			hash[4][HASH_STRIDE], le[4];
 	blake2b_state		state;
-	blake2b_param		param;
-	uint8_t			hash[HASH_BYTES];
 
-	ASSERT (STRING_BITS % BYTE_BITS == 0);
-	ASSERT (STRING_ALIGN_BITS % BYTE_BITS == 0);
-	ASSERT ((STRING_ALIGN_BYTES + STRING_BYTES) % WORD_BYTES == 0);
-	ASSERT (L2_BITS + STEP_BITS <= WORD_BITS);
-	ASSERT (TREE_WORDS == 1);
-	ASSERT (TREE_POS (0) == MEM_WORDS1 - 1);
-	ASSERT (TREE_POS (WK - 1) >= MEM_WORDS (WK - 1) - 1);
+	ASSERT (HASHES % 4 == 0);
+	for (h = h0; h < h1; h += 4) {
+		if (HASH_ZCASH)
+			blake2b_zcash4 (st, h, hash[0]);
+		else for (l = 0; l < 4; l++) {
+			state = *st;
+			for (i = 0; i < 4; i++)
+				le[i] = (h + l) >> (i * BYTE_BITS);
+			blake2b_update (&state, le, sizeof (le));
+			blake2b_final (&state, hash[l], HASH_BYTES);
+		}
 
-	pblock = p;
-	ASSERT (DIV_UP (SOLUTION_NUMS * STRING_IDX_BITS, BYTE_BITS) ==
-	    sizeof (pblock->solution));
+		for (l = 0; l < 4; l++)
+		for (i = 0; i < HASH_STRINGS; i++) {
+			s = (h + l) * HASH_STRINGS + i;
+			if (s < STRINGS)
+				step0_add (ctx, l1, thread, s,
+				    hash[l] + i * STRING_BYTES);
+		}
+	}
+	if (!DENSE)
+		l1_flush (ctx, l1, 0, thread);
+}
+
+static void
+step0_thread (equihash_ctx *ctx, int thread) {
+	step0_hash (ctx, L1 (ctx, 0), &ctx->state, thread);
+}
+
+PARALLEL (step0_thread)
+
+#if DENSE
+static void
+step0_place (equihash_ctx *ctx, int thread) {
+	int			s, i,
+				s0 = HASHES / 4 * thread / ctx->threads * 4
+				    * HASH_STRINGS,
+				s1 = HASHES / 4 * (thread + 1) / ctx->threads * 4
+				    * HASH_STRINGS;
+	word_t			*src, *dst;
+
+	if (s1 > STRINGS)
+		s1 = STRINGS;
+	for (s = s0; s < s1; s++) {
+		src = L1 (ctx, 1)->mem[s];
+		dst = l1_addr (ctx, L1 (ctx, 0), 0, thread,
+		    src[TREE_POS (0)]);
+		for (i = 0; i < MEM_WORDS1 - 1; i++)
+			dst[i] = src[i];
+		dst[TREE_POS (0)] = s;
+	}
+	l1_flush (ctx, L1 (ctx, 0), 0, thread);
+}
+
+PARALLEL (step0_place)
+#endif
+
+static void
+state_init (blake2b_state *st, block_t *p) {
+	blake2b_param		param;
 
 	memset (&param, 0, sizeof (param));
 	memcpy (param.personal, "ZcashPoW", 8);
@@ -186,71 +680,186 @@ step0 (block_t *p) {
 	param.digest_length = HASH_BYTES;
 	param.fanout = 1;
 	param.depth = 1;
-	blake2b_init_param (&state, &param);
-	blake2b_update (&state, (uint8_t *)pblock,
-	    pblock->solsize - pblock->version);
+	blake2b_init_param (st, &param);
+	blake2b_update (st, (uint8_t *)p, p->solsize - p->version);
+}
 
-	l1_init (L1 (0));
-	ASSERT (STRING_BYTES == HASH_BYTES / HASH_STRINGS);
-	for (h = 0; h < HASHES; h++) {
-		blake2b_zcash (&state, h, hash);
+static void
+ctx_wait (equihash_ctx *ctx) {
+	if (ctx->prefaulting) {
+		pthread_join (ctx->prefault, NULL);
+		ctx->prefaulting = 0;
+	}
+#if PIPELINE
+	if (ctx->next_running) {
+		pthread_join (ctx->next_tid, NULL);
+		ctx->next_running = 0;
+	}
+#endif
+}
+
+#if PIPELINE
+/* all parts of step0 one after another, it is a spare core */
+static void *
+next_thread (void *arg) {
+	equihash_ctx	*ctx = arg;
+	int		t;
+
+	l1_init (ctx, ctx->next_l1);
+	for (t = 0; t < ctx->threads; t++)
+		step0_hash (ctx, ctx->next_l1, &ctx->next_state, t);
+	return NULL;
+}
+#endif
+
+/* steps 0 and 1 tables are busy till step WK is done, the third is not */
+void
+equihash_step0_next (equihash_ctx *ctx, block_t *p) {
+#if PIPELINE
+	ctx_wait (ctx);
+	state_init (&ctx->next_state, p);
+	memcpy (ctx->next_header, p, sizeof (ctx->next_header));
+	ctx->next_running = !pthread_create (&ctx->next_tid, NULL,
+	    next_thread, ctx);
+	ctx->next_ready = ctx->next_running;
+#else
+	(void)ctx;
+	(void)p;
+#endif
+}
+
+void
+equihash_step0 (equihash_ctx *ctx, block_t *p) {
+#if PIPELINE
+	l1_t			*l1;
+#endif
+
+	ctx_wait (ctx);
+	ASSERT (STRING_BITS % BYTE_BITS == 0);
+	ASSERT (STRING_ALIGN_BITS % BYTE_BITS == 0);
+	ASSERT ((STRING_ALIGN_BYTES + STRING_BYTES) % WORD_BYTES == 0);
+	ASSERT (L2_BITS + STEP_BITS <= WORD_BITS);
+	ASSERT (TREE_WORDS == 1);
+	ASSERT (TREE_POS (0) >= MEM_WORDS1 - 1);
+	ASSERT (TREE_POS (WK - 1) >= MEM_WORDS (WK - 1) - 1);
 
-		for (i = 0; i < HASH_STRINGS; i++)
-			step0_add (h * HASH_STRINGS + i,
-			    hash + i * STRING_BYTES);
+	ctx->block = p;
+	ASSERT (SOLSIZE_BYTES + SOLUTION_BYTES <=
+	    sizeof (p->solsize) + sizeof (p->solution));
+
+	ctx->stop = 0;
+	ctx->run_sols = 0;
+#if PIPELINE
+	if (ctx->next_ready &&
+	    !memcmp (ctx->next_header, p, sizeof (ctx->next_header))) {
+		ctx->next_ready = 0;
+		l1 = ctx->tab[0];
+		ctx->tab[0] = ctx->next_l1;
+		ctx->next_l1 = l1;
+		l1_fill (ctx, L1 (ctx, 0), 0);
+		return;
 	}
+	ctx->next_ready = 0;
+#endif
+	state_init (&ctx->state, p);
+	l1_init (ctx, L1 (ctx, 0));
+	ASSERT (STRING_BYTES == HASH_BYTES / HASH_STRINGS);
+	parallel (ctx, step0_thread, step0_thread_start);
+#if DENSE
+	dense_layout (ctx, L1 (ctx, 0), 0);
+	parallel (ctx, step0_place, step0_place_start);
+#endif
+	l1_fill (ctx, L1 (ctx, 0), 0);
 	if (DEBUG) {
 		printf ("step0\n");
 		fflush (stdout);
 	}
 }
 
+/*
+ * leaves of a solution are found level by level in place, then sorted
+ * by radix passes of SORT_BITS to find a repeated one, which is what
+ * the pairwise checks at every tree node came to.  last, every pair of
+ * subtrees is put smaller first, bottom up
+ */
+#define SORT_BITS		8
+#define SORT_PASSES		DIV_UP (STRING_IDX_BITS, SORT_BITS)
+
 static int
-tree_restore (int step, word_t *sol, word_t tree) {
-	int		i, j,
-			k = 1 << (step - 1),
-			i1 = TREE_L1 (tree),
-			i2a = TREE_L2A (tree),
-			i2b = TREE_L2B (tree);
+tree_dupes (word_t *sol) {
+	word_t		buf[2][SOLUTION_NUMS], *src = sol, *dst;
+	int		cnt[1 << SORT_BITS];
+	int		i, p, shift, sum, t;
 
-	if (step == 0) {
-		*sol = tree;
-		return 1;
+	for (p = 0; p < SORT_PASSES; p++) {
+		shift = p * SORT_BITS;
+		dst = buf[p & 1];
+		memset (cnt, 0, sizeof (cnt));
+		for (i = 0; i < SOLUTION_NUMS; i++)
+			cnt[src[i] >> shift & ((1 << SORT_BITS) - 1)]++;
+		for (i = sum = 0; i < 1 << SORT_BITS; i++) {
+			t = cnt[i];
+			cnt[i] = sum;
+			sum += t;
+		}
+		for (i = 0; i < SOLUTION_NUMS; i++)
+			dst[cnt[src[i] >> shift & ((1 << SORT_BITS) - 1)]++] =
+			    src[i];
+		src = dst;
 	}
+	for (i = 1; i < SOLUTION_NUMS; i++)
+		if (src[i] == src[i - 1])
+			return 1;
+	return 0;
+}
 
-#define T(i2)	L1 (step - 1)->mem[i1][i2][TREE_POS (step - 1)]
-	if (!tree_restore (step - 1, sol    , T (i2a)))
-		return 0;
-	if (!tree_restore (step - 1, sol + k, T (i2b)))
-		return 0;
-#undef T
-
-	for (i = 0; i < k; i++)
-	for (j = 0; j < k; j++)
-		if (sol[i] == sol[j + k])
-			return 0;
+static int
+tree_restore (equihash_ctx *ctx, word_t *sol, word_t tree) {
+	int		i, j, k, step;
+	word_t		t;
 
-	if (sol[0] > sol[k]) {
-		for (i = 0; i < k; i++) {
-			j = sol[i];
-			sol[i] = sol[i + k];
-			sol[i + k] = j;
+	sol[0] = tree;
+	for (step = WK; step > 0; step--) {
+		/* from the end, sol[i] moves to sol[2i], sol[2i+1] */
+		for (i = (1 << (WK - step)) - 1; i >= 0; i--) {
+			t = sol[i];
+#define T(i2)	STR (ctx, L1 (ctx, step - 1), step - 1, TREE_L1 (t), i2) \
+		    [TREE_AT (step - 1)]
+			sol[2 * i] = T (TREE_L2A (t));
+			sol[2 * i + 1] = T (TREE_L2B (t));
+#undef T
 		}
 	}
+
+	if (tree_dupes (sol))
+		return 0;
+
+	for (k = 1; k < SOLUTION_NUMS; k <<= 1)
+		for (j = 0; j < SOLUTION_NUMS; j += 2 * k)
+			if (sol[j] > sol[j + k])
+				for (i = j; i < j + k; i++) {
+					t = sol[i];
+					sol[i] = sol[i + k];
+					sol[i + k] = t;
+				}
 	return 1;
 }
 
 static int
-check_sol (word_t tree) {
+check_sol (equihash_ctx *ctx, int thread, word_t tree) {
+	block_t		*pblock = ctx->block;
 	word_t		sol[SOLUTION_NUMS];
+	uint8_t		*enc, *bits;
 	int		i;
 #if DEBUG
 	int		j;
 	word_t		xor, nok;
 #endif
 
-	if (!tree_restore (WK, sol, tree))
+	if (!tree_restore (ctx, sol, tree)) {
+		ctx->stat[thread].rejected++;
 		return 0;
+	}
 
 #if DEBUG
 	printf ("solution");
@@ -262,7 +871,7 @@ check_sol (word_t tree) {
 	for (j = 0; j < STRING_WORDS; j++) {
 		xor = 0;
 		for (i = 0; i < SOLUTION_NUMS; i++)
-			xor ^= orig[ sol[i] ][j];
+			xor ^= ctx->orig[ sol[i] ][j];
 		printf (" %x", xor);
 		nok |= xor;
 	}
@@ -271,111 +880,637 @@ check_sol (word_t tree) {
 		die ("not ok");
 #endif
 
-	ASSERT (sizeof (pblock->solution) >= 0xfd);
-	ASSERT (sizeof (pblock->solution) <= 0xffff);
-	pblock->solsize[0] = 0xfd;
-	pblock->solsize[1] = (uint8_t)(sizeof (pblock->solution));
-	pblock->solsize[2] = (uint8_t)(sizeof (pblock->solution) >> 8);
+	pthread_mutex_lock (&ctx->sol_mutex);
+	ASSERT (SOLUTION_BYTES <= 0xffff);
+	enc = (uint8_t *)pblock + offsetof (block_t, solsize);
+	bits = enc + SOLSIZE_BYTES;
+	if (SOLSIZE_BYTES == 1) {
+		enc[0] = (uint8_t)SOLUTION_BYTES;
+	} else {
+		enc[0] = 0xfd;
+		enc[1] = (uint8_t)(SOLUTION_BYTES);
+		enc[2] = (uint8_t)(SOLUTION_BYTES >> 8);
+	}
 
-	memset (pblock->solution, 0, sizeof (pblock->solution));
+	memset (bits, 0, SOLUTION_BYTES);
 	for (i = 0; i < SOLUTION_NUMS * STRING_IDX_BITS; i++)
 		if (sol[i / STRING_IDX_BITS] &
 		    (1 << (STRING_IDX_BITS - 1 - i % STRING_IDX_BITS)))
-			pblock->solution[i / 8] |= 1 << (7 - i % 8);
+			bits[i / 8] |= 1 << (7 - i % 8);
+
+	ctx->run_sols++;
+	if (ctx->solution (ctx, pblock, ctx->arg))
+		ctx->stop = 1;
+	pthread_mutex_unlock (&ctx->sol_mutex);
+	return ctx->stop;
+}
 
-	return solution ();
+#if DENSE
+#define COUNTING(ctx)		((ctx)->counting)
+/* thread's part of pairs, its boxes are an even share of all */
+#define PAIRS(ctx,thread)	((ctx)->pairs + DENSE_STRINGS / \
+				    (ctx)->threads * (thread))
+#define NPAIRS(ctx,thread)	((ctx)->npairs[thread])
+
+/* the counting pass keeps the tree of a pair for the placing pass */
+static inline void
+dense_keep (equihash_ctx *ctx, l1_t *l1, int step, int thread, word_t i1,
+    word_t tree) {
+	int		n = ctx->npairs[thread];
+
+	if (n >= DENSE_STRINGS / ctx->threads) {
+		ctx->stat[thread].dropped[step]++;
+		return;
+	}
+	PAIRS (ctx, thread)[n] = tree;
+	ctx->npairs[thread] = n + 1;
+	l1->cnt[thread][i1]++;
+}
+#else
+#define COUNTING(ctx)		0
+#define PAIRS(ctx,thread)	((word_t *)NULL)
+#define NPAIRS(ctx,thread)	0
+#define dense_keep(ctx,l1,step,thread,i1,tree)	((void)0)
+#endif
+
+/*
+ * pc[0..n - 1] = pa[0..n - 1] ^ pb[0..n - 1], may write pc up to
+ * pc[room - 1] and read pa, pb as far, as they are in the same slot
+ */
+static inline void
+slot_xor (word_t *pc, word_t *pa, word_t *pb, int n, int room) {
+	int		i = 0;
+
+#if SLOT_PAD && defined (__AVX2__)
+	if (n > 4 && room >= 8) {
+		_mm256_storeu_si256 ((__m256i *)pc, _mm256_xor_si256 (
+		    _mm256_loadu_si256 ((__m256i *)pa),
+		    _mm256_loadu_si256 ((__m256i *)pb)));
+		return;
+	}
+#endif
+#if SLOT_PAD && defined (__SSE2__)
+	for (; i < n && i + 4 <= room; i += 4)
+		_mm_storeu_si128 ((__m128i *)(pc + i), _mm_xor_si128 (
+		    _mm_loadu_si128 ((__m128i *)(pa + i)),
+		    _mm_loadu_si128 ((__m128i *)(pb + i))));
+#else
+	(void)room;
+#endif
+	for (; i < n; i++)
+		pc[i] = pa[i] ^ pb[i];
+}
+
+/* a and b are made of the same string of the step before */
+static inline int
+tree_dupe (word_t a, word_t b) {
+	return TREE_L1 (a) == TREE_L1 (b) &&
+	    (TREE_L2A (a) == TREE_L2A (b) || TREE_L2A (a) == TREE_L2B (b) ||
+	    TREE_L2B (a) == TREE_L2A (b) || TREE_L2B (a) == TREE_L2B (b));
+}
+
+/*
+ * step WK only keeps the trees of full collisions, sols_check then
+ * restores, checks and passes them on after the step, every thread
+ * its own ones
+ */
+static inline void
+cand_add (equihash_ctx *ctx, int thread, word_t tree) {
+	if (ctx->cands[thread] < CANDS_MAX) {
+		ctx->cand[thread][ctx->cands[thread]++] = tree;
+		return;
+	}
+	/* step WK writes no table, its sources are safe to read now */
+	ctx->stat[thread].cands_inline++;
+	check_sol (ctx, thread, tree);
+}
+
+static void
+sols_check (equihash_ctx *ctx, int thread) {
+	int		i;
+
+	for (i = 0; i < ctx->cands[thread] && !ctx->stop; i++)
+		check_sol (ctx, thread, ctx->cand[thread][i]);
+}
+PARALLEL (sols_check)
+
+#if IDX_STEPS
+/* payload of a string of index-only step s, from its parents */
+static void
+lazy_load (equihash_ctx *ctx, int s, word_t tree, word_t *out) {
+	l1_t		*l1 = L1 (ctx, s - 1);
+	word_t		a[SLOT_WORDS], b[SLOT_WORDS], *pa, *pb;
+	int		i, decr = MEM_WORDS (s) - MEM_WORDS (s + 1);
+
+	pa = SLOT (ctx, l1, s - 1, TREE_L1 (tree), TREE_L2A (tree));
+	pb = SLOT (ctx, l1, s - 1, TREE_L1 (tree), TREE_L2B (tree));
+	if (LAZY (s - 1)) {
+		lazy_load (ctx, s - 1, pa[TREE_POS (s - 1)], a);
+		lazy_load (ctx, s - 1, pb[TREE_POS (s - 1)], b);
+		pa = a;
+		pb = b;
+	}
+	for (i = 0; i < MEM_WORDS (s + 1) - 1; i++)
+		out[i] = pa[decr + i] ^ pb[decr + i];
+}
+
+/* whole box i1 of index-only step s, to the thread's buffer */
+static inline void
+lazy_box (equihash_ctx *ctx, int s, int thread, int i1) {
+	l1_t		*l1 = L1 (ctx, s);
+	word_t		*src, *dst;
+	int		t, j, i2;
+
+	for (t = 0; t < PARTS (ctx); t++)
+	for (j = 0; j < l1->cnt[t][i1]; j++) {
+		i2 = SUB (ctx, l1, t, i1) + j;
+		src = SLOT (ctx, l1, s, i1, i2);
+		dst = ctx->lazy[thread][i2];
+		lazy_load (ctx, s, src[TREE_POS (s)], dst);
+		dst[TREE_POS (s)] = src[TREE_POS (s)];
+	}
+}
+
+#define SRC(ctx,l1,step,thread,i1,i2) (LAZY (step) ? \
+				    (ctx)->lazy[thread][i2] : \
+				    SLOT (ctx, l1, step, i1, i2))
+#else
+#define lazy_box(ctx,s,thread,i1)	((void)0)
+#define SRC(ctx,l1,step,thread,i1,i2)	STR (ctx, l1, step, i1, i2)
+#endif
+
+/* thread 0 only, the others see stop before their next box */
+static void
+cancel_poll (equihash_ctx *ctx, int thread, int boxes) {
+	if (thread || !boxes || boxes % CANCEL_BOXES || !ctx->cancel ||
+	    ctx->stop)
+		return;
+	if (ctx->cancel (ctx, ctx->arg)) {
+		ctx->stop = 1;
+		ctx->cancels++;
+	}
 }
 
 #define GENSTEP(step) \
-void \
-genstep##step (void) { \
+/* pair of slots i2a, i2b of box i1 into box c12 of the next table */ \
+static inline void \
+genstore##step (equihash_ctx *ctx, int thread, int i1, int i2a, int i2b, \
+    word_t *pa, word_t *pb, word_t c12) { \
 	const int	WORDS = MEM_WORDS (step); \
 	const int	WORDS_NEXT = MEM_WORDS (step + 1); \
 	const int	DECR = WORDS - WORDS_NEXT; \
-	l1_t		*l1f = L1 (step - 1); \
-	l1_t		*l1t = L1 (step); \
-	int		i1, i2a, a2, i3, ib, i2b, i; \
+	word_t		*pc; \
+	\
+	pc = l1_addr (ctx, L1 (ctx, step), step, thread, c12 >> L2_BITS); \
+	/* tree word goes after, older ones above */ \
+	if (!LAZY (step)) \
+		slot_xor (pc, pa + DECR, pb + DECR, WORDS_NEXT - 1, \
+		    TREE_AT (step) + 1 < SLOT_WORDS - DECR ? \
+		    TREE_AT (step) + 1 : SLOT_WORDS - DECR); \
+	ASSERT (WORDS_NEXT - 1 <= TREE_AT (step)); \
+	ASSERT (i1 < L1_BOXES); \
+	ASSERT (i2a <= L2Z_MASK); \
+	ASSERT (i2b <= L2Z_MASK); \
+	pc[TREE_AT (step)] = TREE (i1, i2a, i2b); \
+} \
+\
+static inline void \
+genbox##step (equihash_ctx *ctx, int thread, int i1, int i1e) { \
+	const int	WORDS = MEM_WORDS (step); \
+	l1_t		*l1f = L1 (ctx, step - 1); \
+	int		i2a, a2, i3, ib, i2b, i, t, j; \
 	word_t		a212, b2z, c12; \
-	word_t		*pa, *pb, *pc; \
+	word_t		*pa, *pb; \
 	uint8_t		l3cnt[L2_BOXES]; \
 	word_t		l3i2[L2_BOXES][L3_STRINGS]; \
 	\
-	l1_init (l1t); \
-	if (DEBUG) { \
-		printf ("step %d\n", step); \
-		fflush (stdout); \
-	} \
-	for (i1 = 0; i1 < L1_BOXES; i1++) { \
+	{ \
 		memset (l3cnt, 0, sizeof (l3cnt)); \
-		for (i2a = l1f->cnt[i1] - 1; i2a >= 0; i2a--) { \
+		if (LAZY (step - 1)) \
+			lazy_box (ctx, step - 1, thread, i1); \
+		if (PREFETCH && i1 + 1 < i1e) { \
+			t = PARTS (ctx) - 1; \
+			j = l1f->cnt[t][i1 + 1]; \
+			for (i = 1; i <= PREFETCH && i <= j; i++) \
+				PREFETCH_SLOT (STR (ctx, l1f, step - 1, \
+				    i1 + 1, SUB (ctx, l1f, t, i1 + 1) + j - i)); \
+		} \
+		for (t = PARTS (ctx) - 1; t >= 0; t--) \
+		for (j = l1f->cnt[t][i1] - 1; j >= 0; j--) { \
+			i2a = SUB (ctx, l1f, t, i1) + j; \
 			ASSERT (i2a <= L2Z_MASK); \
-			pa = l1f->mem[i1][i2a]; \
+			if (PREFETCH && j >= PREFETCH) \
+				PREFETCH_SLOT (STR (ctx, l1f, step - 1, i1, \
+				    i2a - PREFETCH)); \
+			pa = SRC (ctx, l1f, step - 1, thread, i1, i2a); \
 			a212 = l212_val (step, pa); \
 			a2 = a212 >> STEP_BITS; \
-			i3 = l3cnt[a2]++; \
-			if (DEBUG && i3 >= L3_STRINGS) \
-				die ("no l3"); \
-			l3i2[a2][i3] = L12L2Z (a212, i2a); \
+			i3 = l3cnt[a2]; \
+			if (i3 < L3_STRINGS) { \
+				l3i2[a2][i3] = L12L2Z (a212, i2a); \
+				l3cnt[a2]++; \
+			} else { \
+				/* paired, but not kept for later ones */ \
+				if (DEBUG) \
+					die ("no l3"); \
+				if (!COUNTING (ctx)) \
+					ctx->stat[thread].l3_dropped[step]++; \
+			} \
 			for (ib = i3 - 1; ib >= 0; ib--) { \
 				b2z = l3i2[a2][ib]; \
 				i2b = L12L2Z_L2Z (b2z); \
-				pb = l1f->mem[i1][i2b]; \
+				pb = SRC (ctx, l1f, step - 1, thread, i1, i2b); \
 				if (step < WK && \
 				    pa[WORDS - 2] == pb[WORDS - 2]) { \
 					continue; \
 				} \
+				if (step >= DUPE_STEP && step > 1 && \
+				    tree_dupe (pa[TREE_AT (step - 1)], \
+				    pb[TREE_AT (step - 1)])) \
+					continue; \
 				c12 = (a212 ^ L12L2Z_L12 (b2z)) \
 				    & L12_MASK; \
 				if (step == WK) { \
-					if (!c12 && \
-					    check_sol (TREE (i1, i2a, i2b))) \
-						return; \
+					if (!c12) \
+						cand_add (ctx, thread, \
+						    TREE (i1, i2a, i2b)); \
 					continue; \
 				} \
-				pc = l1_addr (l1t, c12 >> L2_BITS); \
-				for (i = 0; i < WORDS_NEXT - 1; i++) \
-					pc[i] = pa[i + DECR] ^ pb[i + DECR]; \
-				ASSERT (i <= TREE_POS (step)); \
-				ASSERT (i1 < L1_BOXES); \
-				ASSERT (i2a <= L2Z_MASK); \
-				ASSERT (i2b <= L2Z_MASK); \
-				pc[TREE_POS (step)] = TREE (i1, i2a, i2b); \
+				if (COUNTING (ctx)) { \
+					dense_keep (ctx, L1 (ctx, step), step, \
+					    thread, c12 >> L2_BITS, \
+					    TREE (i1, i2a, i2b)); \
+					continue; \
+				} \
+				genstore##step (ctx, thread, i1, i2a, i2b, \
+				    pa, pb, c12); \
 			} \
 		} \
 	} \
+} \
+\
+/* DENSE placing pass, pairs the counting pass kept, box by box */ \
+static inline void \
+genlist##step (equihash_ctx *ctx, int thread) { \
+	l1_t		*l1f = L1 (ctx, step - 1); \
+	word_t		*tree = PAIRS (ctx, thread); \
+	word_t		*pa, *pb; \
+	int		n, i1 = -1, i2a, i2b, boxes = 0; \
+	\
+	for (n = 0; n < NPAIRS (ctx, thread); n++) { \
+		if ((int)TREE_L1 (tree[n]) != i1) { \
+			i1 = TREE_L1 (tree[n]); \
+			cancel_poll (ctx, thread, boxes++); \
+			if (ctx->stop) \
+				break; \
+			if (LAZY (step - 1)) \
+				lazy_box (ctx, step - 1, thread, i1); \
+		} \
+		i2a = TREE_L2A (tree[n]); \
+		i2b = TREE_L2B (tree[n]); \
+		pa = SRC (ctx, l1f, step - 1, thread, i1, i2a); \
+		pb = SRC (ctx, l1f, step - 1, thread, i1, i2b); \
+		genstore##step (ctx, thread, i1, i2a, i2b, pa, pb, \
+		    (l212_val (step, pa) ^ l212_val (step, pb)) & L12_MASK); \
+	} \
+} \
+\
+static void \
+genstep##step (equihash_ctx *ctx, int thread) { \
+	int		i1, i1s, i1e; \
+	\
+	i1s = L1_BOXES * thread / ctx->threads; \
+	i1e = L1_BOXES * (thread + 1) / ctx->threads; \
+	/* DENSE places what its counting pass paired */ \
+	if (DENSE && step < WK && !COUNTING (ctx)) { \
+		genlist##step (ctx, thread); \
+		i1e = i1s; \
+	} \
+	for (i1 = i1s; i1 < i1e; i1++) { \
+		cancel_poll (ctx, thread, i1 - i1s); \
+		if (ctx->stop) \
+			break; \
+		genbox##step (ctx, thread, i1, i1e); \
+	} \
+	if (step < WK && !COUNTING (ctx)) \
+		l1_flush (ctx, L1 (ctx, step), step, thread); \
+} \
+PARALLEL (genstep##step) \
+\
+/* two single thread solves, box by box */ \
+static void \
+genpair##step (equihash_ctx *a, equihash_ctx *b) { \
+	int		i1; \
+	\
+	for (i1 = 0; i1 < L1_BOXES; i1++) { \
+		cancel_poll (a, 0, i1); \
+		cancel_poll (b, 0, i1); \
+		if (!a->stop) \
+			genbox##step (a, 0, i1, L1_BOXES); \
+		if (!b->stop) \
+			genbox##step (b, 0, i1, L1_BOXES); \
+	} \
+	if (step < WK) { \
+		l1_flush (a, L1 (a, step), step, 0); \
+		l1_flush (b, L1 (b, step), step, 0); \
+	} \
 }
 
+/* steps past WK would have no payload left, so only 1..WK exist */
 GENSTEP(1)
 GENSTEP(2)
 GENSTEP(3)
 GENSTEP(4)
 GENSTEP(5)
+#if WK >= 6
 GENSTEP(6)
+#endif
+#if WK >= 7
 GENSTEP(7)
+#endif
+#if WK >= 8
 GENSTEP(8)
+#endif
+#if WK >= 9
 GENSTEP(9)
+#endif
+#if WK < 5 || WK > 9
+#error "WK must be 5..9"
+#endif
+
+typedef struct {
+	void	(*fn) (equihash_ctx *ctx, int thread);
+	void	*(*start) (void *arg);
+	void	(*pair) (equihash_ctx *a, equihash_ctx *b);
+} genstep_t;
+
+#define G(n)	{ genstep##n, genstep##n##_start, genpair##n }
+static const genstep_t	gensteps[WK] = {
+	G (1), G (2), G (3), G (4), G (5),
+#if WK >= 6
+	G (6),
+#endif
+#if WK >= 7
+	G (7),
+#endif
+#if WK >= 8
+	G (8),
+#endif
+#if WK >= 9
+	G (9),
+#endif
+};
+#undef G
+
+static void
+step_begin (equihash_ctx *ctx, int step) {
+	if (step < 1 || step > WK)
+		die ("wtf");
+	if (DEBUG) {
+		printf ("step %d\n", step);
+		fflush (stdout);
+	}
+	if (step < WK)
+		l1_init (ctx, L1 (ctx, step));
+	else
+		memset (ctx->cands, 0, sizeof (ctx->cands));
+}
+
+static void
+step_end (equihash_ctx *ctx, int step) {
+	/* stopped halfway, the tables are started over by step0 */
+	if (ctx->stop)
+		return;
+	if (step < WK) {
+		l1_fill (ctx, L1 (ctx, step), step);
+		return;
+	}
+	parallel (ctx, sols_check, sols_check_start);
+	if (!ctx->stop) {
+		ctx->runs++;
+		ctx->sols += ctx->run_sols;
+		ctx->sols_avg = ctx->runs == 1 ? ctx->run_sols :
+		    ctx->sols_avg * (1 - SOLS_ALPHA) +
+		    ctx->run_sols * SOLS_ALPHA;
+	}
+}
 
 void
-step (int step) {
-	switch (step) {
-	case 1: genstep1 (); break;
-	case 2: genstep2 (); break;
-	case 3: genstep3 (); break;
-	case 4: genstep4 (); break;
-	case 5: genstep5 (); break;
-	case 6: genstep6 (); break;
-	case 7: genstep7 (); break;
-	case 8: genstep8 (); break;
-	case 9: genstep9 (); break;
-	default: die ("wtf");
+equihash_step (equihash_ctx *ctx, int step) {
+	const genstep_t	*g;
+
+	if (ctx->stop)
+		return;
+	step_begin (ctx, step);
+	g = &gensteps[step - 1];
+#if DENSE
+	if (step < WK) {
+		ctx->counting = 1;
+		memset (ctx->npairs, 0, sizeof (ctx->npairs));
+		parallel (ctx, g->fn, g->start);
+		ctx->counting = 0;
+		dense_layout (ctx, L1 (ctx, step), step);
 	}
+#endif
+	parallel (ctx, g->fn, g->start);
+	step_end (ctx, step);
 }
 
+/*
+ * a step of two single thread solves on one thread, boxes of both in
+ * turn, so misses of one overlap work on the other.  with DENSE (two
+ * passes), more threads or a stopped one they go one after the other
+ */
+void
+equihash_step_pair (equihash_ctx *a, equihash_ctx *b, int step) {
+	if (DENSE || a->threads > 1 || b->threads > 1 || a->stop ||
+	    b->stop) {
+		equihash_step (a, step);
+		equihash_step (b, step);
+		return;
+	}
+	step_begin (a, step);
+	step_begin (b, step);
+	gensteps[step - 1].pair (a, b);
+	step_end (a, step);
+	step_end (b, step);
+}
+
+static equihash_ctx *
+ctx_alloc (void) {
+	equihash_ctx	*ctx;
+	size_t		size = DIV_UP (sizeof (*ctx), HUGE_BYTES) * HUGE_BYTES;
+	char		*p, *a;
+
+#ifdef MAP_HUGETLB
+	p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		ctx = (equihash_ctx *)p;
+		ctx->pages = "hugetlb";
+		ctx->size = size;
+		return ctx;
+	}
+#endif
+	/* THP wants 2 MB aligned memory, ends past that are unmapped */
+	p = mmap (NULL, size + HUGE_BYTES, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		die ("no mem for equihash context");
+	a = p + (HUGE_BYTES - (size_t)p % HUGE_BYTES) % HUGE_BYTES;
+	if (a > p)
+		munmap (p, a - p);
+	munmap (a + size, p + HUGE_BYTES - a);
+	ctx = (equihash_ctx *)a;
+	ctx->pages = "4k";
+#ifdef MADV_HUGEPAGE
+	if (!madvise (a, size, MADV_HUGEPAGE))
+		ctx->pages = "thp";
+#endif
+	ctx->size = size;
+	return ctx;
+}
+
+/* tables are not used before step0, so zeroes do no harm */
+static void *
+ctx_prefault (void *arg) {
+	equihash_ctx	*ctx = arg;
+	volatile char	*p = (char *)&ctx->l1x,
+			*e = (char *)ctx + ctx->size;
+
+	for (; p < e; p += PAGE_BYTES)
+		*p = 0;
+	return NULL;
+}
+
+equihash_ctx *
+equihash_new (int n, int k, int threads, equihash_solution_t solution,
+    void *arg) {
+	equihash_ctx	*ctx;
+	int		t;
+
+	if (n != WN || k != WK)
+		return NULL;
+	if (threads < 1 || threads > THREADS_MAX)
+		die ("bad number of threads");
+	/* own parts of a box of at least 2 slots */
+	if (threads > STRINGS / L1_BOXES / 2)
+		die ("too many threads for the box size of this n,k");
+	ctx = ctx_alloc ();
+#if PIPELINE
+	ctx->tab[0] = &ctx->l1x;
+	ctx->tab[1] = &ctx->l1y;
+	ctx->next_l1 = &ctx->l1z;
+	ctx->next_running = ctx->next_ready = 0;
+#endif
+	ctx->block = NULL;
+	ctx->threads = threads;
+	/* one thread has the whole box, no atomics */
+	ctx->l1_cap = threads > 1 ? STRINGS / L1_BOXES / threads :
+	    L2_STRINGS;
+	ctx->stop = 0;
+	memset (ctx->stat, 0, sizeof (ctx->stat));
+	ctx->runs = ctx->sols = ctx->run_sols = ctx->cancels = 0;
+	ctx->sols_avg = 0;
+	memset (ctx->fill, 0, sizeof (ctx->fill));
+	pthread_mutex_init (&ctx->sol_mutex, NULL);
+	ctx->solution = solution;
+	ctx->cancel = NULL;
+	ctx->arg = arg;
+#if WC_SLOTS
+	if (posix_memalign ((void **)&ctx->wc, 64,
+	    sizeof (word_t) * threads * L1_BOXES * WC_WORDS))
+		die ("no mem for staging");
+#endif
+	for (t = 0; t < THREADS_MAX; t++) {
+		ctx->thread_arg[t].ctx = ctx;
+		ctx->thread_arg[t].thread = t;
+	}
+	ctx->prefaulting = !pthread_create (&ctx->prefault, NULL,
+	    ctx_prefault, ctx);
+	return ctx;
+}
+
+void
+equihash_free (equihash_ctx *ctx) {
+	ctx_wait (ctx);
+	pthread_mutex_destroy (&ctx->sol_mutex);
+#if WC_SLOTS
+	free (ctx->wc);
+#endif
+	munmap (ctx, ctx->size);
+}
+
+/*
+ * counters are read while solver threads update them, a stale value
+ * is fine here
+ */
 char *
-equihash_info (void) {
-	static char	buf[1024];
+equihash_info (equihash_ctx *ctx) {
+	static char	buf[4096];
+	long		x, boxes;
+	int		n, s, t, i;
+
+	n = snprintf (buf, sizeof (buf), "n %d k %d, word %ld bytes, "
+	    "mem %ld bytes on %s pages, threads %d", WN, WK,
+	    (long)sizeof (word_t), (long)sizeof (*ctx), ctx->pages,
+	    ctx->threads);
+
+	n += snprintf (buf + n, sizeof (buf) - n,
+	    ", runs %ld sols/run %.3f (recent %.3f", ctx->runs,
+	    ctx->runs ? (double)ctx->sols / ctx->runs : 0.0, ctx->sols_avg);
+#ifdef SOLS_IDEAL
+	n += snprintf (buf + n, sizeof (buf) - n, ", %.2f ideal", SOLS_IDEAL);
+#endif
+	n += snprintf (buf + n, sizeof (buf) - n, "), dropped");
+	for (s = 0; s < WK; s++) {
+		for (t = 0, x = 0; t < ctx->threads; t++)
+			x += ctx->stat[t].dropped[s];
+		n += snprintf (buf + n, sizeof (buf) - n, "%s%ld",
+		    s ? "/" : " ", x);
+	}
+	n += snprintf (buf + n, sizeof (buf) - n, ", l3 dropped");
+	for (s = 1; s <= WK; s++) {
+		for (t = 0, x = 0; t < ctx->threads; t++)
+			x += ctx->stat[t].l3_dropped[s];
+		n += snprintf (buf + n, sizeof (buf) - n, "%s%ld",
+		    s > 1 ? "/" : " ", x);
+	}
+	for (t = 0, x = 0; t < ctx->threads; t++)
+		x += ctx->stat[t].rejected;
+	n += snprintf (buf + n, sizeof (buf) - n, ", rejected %ld", x);
+	for (t = 0, x = 0; t < ctx->threads; t++)
+		x += ctx->stat[t].cands_inline;
+	n += snprintf (buf + n, sizeof (buf) - n, ", cands inline %ld", x);
+	n += snprintf (buf + n, sizeof (buf) - n, ", cancelled %ld",
+	    ctx->cancels);
 
-	snprintf (buf, sizeof (buf), "word %ld bytes, mem %ld bytes",
-	    (long)sizeof (word_t), (long)sizeof (l1x) * 2);
+	/* % of boxes by fill in 1/FILL_BINS of L2_STRINGS, full last */
+	n += snprintf (buf + n, sizeof (buf) - n, ", fill");
+	for (s = 0; s < WK; s++) {
+		for (i = 0, boxes = 0; i <= FILL_BINS; i++)
+			boxes += ctx->fill[s][i];
+		for (i = 0; i <= FILL_BINS; i++)
+			n += snprintf (buf + n, sizeof (buf) - n, "%s%ld",
+			    i ? "/" : " ",
+			    boxes ? ctx->fill[s][i] * 100 / boxes : 0);
+	}
 	return buf;
 }
+
+void
+equihash_set_cancel (equihash_ctx *ctx, equihash_cancel_t cancel) {
+	ctx->cancel = cancel;
+}
+
+int
+equihash_steps (equihash_ctx *ctx) {
+	(void)ctx;
+	return WK;
+}
+
+int
+equihash_block_bytes (equihash_ctx *ctx) {
+	(void)ctx;
+	return offsetof (block_t, solsize) + SOLSIZE_BYTES + SOLUTION_BYTES;
+}
@@ -1,9 +1,17 @@
 #ifndef EQUIHASH_H
 #define EQUIHASH_H
 
+/* parameters of a single solver build, dispatch builds set them by -D */
+#ifndef WN
 #define WN			200
 #define WK			9
+#endif
 
+/*
+ * solsize and solution hold the compact size and the solution back
+ * to back, equihash_block_bytes() long with the header, the largest
+ * solution (200,9) takes them whole
+ */
 typedef struct {
 	unsigned char	version[4];
 	unsigned char	prevhash[32];
@@ -18,9 +26,58 @@ typedef struct {
 
 typedef char equihash_dummy_t[1 / (sizeof (block_t) == 1487)];
 
-char		*equihash_info (void);
-void		step0 (block_t *block);
-void		step (int step);	/* 1..WK */
-int		solution (void);	/* implemented by caller */
+/*
+ * with runtime dispatch (EQUIHASH = dispatch in Makefile) the solver
+ * is compiled once per (n,k) with -DEQUIHASH_VARIANT=n_k and its names
+ * become equihash_n_k_new and so on, equihash-dispatch picks one
+ */
+#define EQUIHASH_FN(v,f)	equihash_##v##_##f
+#define EQUIHASH_FN_(v,f)	EQUIHASH_FN (v, f)
+
+#ifdef EQUIHASH_VARIANT
+#define equihash_ctx		EQUIHASH_FN_ (EQUIHASH_VARIANT, ctx)
+#define equihash_solution_t	EQUIHASH_FN_ (EQUIHASH_VARIANT, solution_t)
+#define equihash_cancel_t	EQUIHASH_FN_ (EQUIHASH_VARIANT, cancel_t)
+#define equihash_set_cancel	EQUIHASH_FN_ (EQUIHASH_VARIANT, set_cancel)
+#define equihash_new		EQUIHASH_FN_ (EQUIHASH_VARIANT, new)
+#define equihash_free		EQUIHASH_FN_ (EQUIHASH_VARIANT, free)
+#define equihash_info		EQUIHASH_FN_ (EQUIHASH_VARIANT, info)
+#define equihash_step0		EQUIHASH_FN_ (EQUIHASH_VARIANT, step0)
+#define equihash_step0_next	EQUIHASH_FN_ (EQUIHASH_VARIANT, step0_next)
+#define equihash_step		EQUIHASH_FN_ (EQUIHASH_VARIANT, step)
+#define equihash_step_pair	EQUIHASH_FN_ (EQUIHASH_VARIANT, step_pair)
+#define equihash_steps		EQUIHASH_FN_ (EQUIHASH_VARIANT, steps)
+#define equihash_block_bytes	EQUIHASH_FN_ (EQUIHASH_VARIANT, block_bytes)
+#endif
+
+typedef struct equihash_ctx	equihash_ctx;
+
+/* called for every solution found, nonzero return stops the solve */
+typedef int	(*equihash_solution_t) (equihash_ctx *ctx, block_t *block,
+		    void *arg);
+
+/*
+ * polled during the steps (with arg of equihash_new), nonzero return
+ * cancels the solve, its steps left do nothing till the next step0
+ */
+typedef int	(*equihash_cancel_t) (equihash_ctx *ctx, void *arg);
+
+/* NULL if parameters n,k are not compiled in */
+equihash_ctx	*equihash_new (int n, int k, int threads,
+		    equihash_solution_t solution,
+		    void *arg);	/* threads 1..THREADS_MAX */
+void		equihash_free (equihash_ctx *ctx);
+void		equihash_set_cancel (equihash_ctx *ctx,
+		    equihash_cancel_t cancel);	/* NULL for none */
+char		*equihash_info (equihash_ctx *ctx);
+void		equihash_step0 (equihash_ctx *ctx, block_t *block);
+/* step0 of the next block ahead, if built with PIPELINE */
+void		equihash_step0_next (equihash_ctx *ctx, block_t *block);
+void		equihash_step (equihash_ctx *ctx, int step);	/* 1..k */
+/* same step of two solves interleaved on the calling thread */
+void		equihash_step_pair (equihash_ctx *a, equihash_ctx *b,
+		    int step);
+int		equihash_steps (equihash_ctx *ctx);	/* k */
+int		equihash_block_bytes (equihash_ctx *ctx);
 
 #endif
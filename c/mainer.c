@@ -4,9 +4,11 @@
  * is not compatible with some pools, for example with zcash.flypool.org
  */
 
+#define _GNU_SOURCE		/* sched_setaffinity, CPU_SET */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -14,6 +16,12 @@
 #include <poll.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "jsmn/jsmn.h"
 #include "sha256/sha256.h"
@@ -22,12 +30,21 @@
 
 #define INTERRUPT		1
 #define STAT_ALPHA		0.1
+#define STEP_ALPHA		0.2	/* of step times, for -I */
 #define NONCE_MAXLEN		24
 
 #define VERSION			"04000000"
 #define BUF_SIZE		8192
 #define JSON_TOKENS_MAX		64
 #define TIME_STAT_PERIOD	15
+#define POLL_PERIOD		50	/* ms, network poll with many solvers */
+#define BENCH_STEPS_MAX		10	/* step0 and up to 9 steps */
+#define BENCH_NONCE_BYTES	20	/* random, header bytes 108..127 */
+#define PIPE_STEPS		3	/* next step0 runs along the last ones */
+#define NODES_MAX		64
+#define CHECK_SEED		1
+#define CHECK_SOLS_MAX		64
+#define CHECK_FP_BYTES		8
 
 static char			pool_host[BUF_SIZE] = "127.0.0.1";
 static int			pool_port = 3333;
@@ -36,8 +53,18 @@ static char			worker_name[BUF_SIZE] =
  				    "t1PsxqaQ1o5PDTALJN2Fn8BxeBvcpQyqKwV";
 static char			worker_pass[BUF_SIZE] = "x";
 static int			flag_bench = 0;
+static int			flag_check = 0;
+static int			flag_numa = 0;
 static int			flag_debug = 0;
 static int			flag_extranonce = 1;
+static int			flag_threads = 1;
+static int			flag_solvers = 1;
+static int			flag_interleave = 0;
+static int			flag_finish = 100;	/* ms */
+static int			flag_n = 200;
+static int			flag_k = 9;
+static unsigned			flag_seed = 1;
+static char			bench_file[BUF_SIZE] = "-";
 
 static int			sock_fh = -1;
 static char			out_buf[BUF_SIZE + 1];
@@ -53,7 +80,9 @@ static block_t			block;
 static int			nonce1_len = 0;
 static char			job_id[BUF_SIZE];
 static uint8_t			target[SHA256_DIGEST_SIZE] = { 0 };
-static int			flag_new_job = 0;
+static volatile int		job_gen = 0;
+static volatile int		clean_gen = 0;	/* jobs with clean_jobs */
+static pthread_mutex_t		mine_mutex = PTHREAD_MUTEX_INITIALIZER;
 static time_t			time_start;
 static time_t			time_last;
 static time_t			time_prev;
@@ -61,12 +90,39 @@ static time_t			time_prev;
 static int			stat_jobs = 0;
 static int			stat_found = 0;
 static int			stat_interrupts = 0;
+static int			stat_finished = 0;	/* stale, not interrupted */
 static int			stat_submitted = 0;
 static int			stat_accepted = 0;
 static int			stat_found_last = 0;
 static int			stat_found_cur = 0;
 static float			speed_avg = -1;
 
+/*
+ * every solver owns an equihash context and a copy of the job,
+ * solver n of N tries nonce2 values n, n + N, n + 2N, ...
+ */
+typedef struct {
+	int			id;
+	pthread_t		tid;
+	equihash_ctx		*ctx;
+	equihash_ctx		*ctx2;	/* with -i, solves block2 along */
+	block_t			block;
+	block_t			block2;
+	int			job_gen;
+	int			clean_gen;
+	char			job_id[BUF_SIZE];
+	block_t			next;	/* next nonce, for step0_next */
+	int			run_found[2];	/* solutions in this solve */
+	int			step;	/* being solved */
+	int			keep_gen;	/* clean_gen finished anyway */
+	volatile int		stopped;	/* by a callback, this solve */
+	double			step_ms[BENCH_STEPS_MAX];	/* averages */
+	int			found;
+	int			node;	/* with -A, else -1 */
+} solver_t;
+
+static solver_t			*solvers;
+
 #define JSONRPC_ID_SUBSCRIBE	1
 #define JSONRPC_ID_AUTHORIZE	2
 #define JSONRPC_ID_EXTRANONCE	3
@@ -74,6 +130,9 @@ static float			speed_avg = -1;
 
 #define JSON_FIRST_CHAR(t)	in_buf[ json_token[t].start ]
 
+#if INTERRUPT
+static int			stale (solver_t *sv);
+#endif
 static void			send_authorize (void);
 static void			send_extranonce (void);
 
@@ -231,6 +290,8 @@ recv_target (int pos_params) {
 
 static void
 recv_job (int pos_params) {
+	int		clean;
+
         if (json_token[pos_params].size == 8)
 		; /* normal */
 	else if (json_token[pos_params].size == 9 &&
@@ -257,9 +318,16 @@ recv_job (int pos_params) {
 	if (json_token[pos_params + 8].type != JSMN_PRIMITIVE)
 	    die ("mining.notify bad clean_jobs");
 
-	Log ("new job %s", job_id);
+	/*
+	 * shares of the jobs before a not clean one are still good, the
+	 * solvers finish their nonce and take it then
+	 */
+	clean = JSON_FIRST_CHAR (pos_params + 8) == 't';
+	Log ("new job %s%s", job_id, clean ? "" : ", not clean");
 	stat_jobs++;
-	flag_new_job = 1;
+	job_gen++;
+	if (clean)
+		clean_gen++;
 }
 
 static void
@@ -433,8 +501,27 @@ sock_open (void) {
 		die ("!connect failed");
 }
 
+static void
+sock_write (void) {
+	int		i;
+
+	if (flag_debug)
+		printf ("out buffer: %s", out_buf + out_pos);
+	i = send (sock_fh, out_buf + out_pos, out_len - out_pos, 0);
+	if (i < 0)
+		die ("!send");
+	out_pos += i;
+	if (out_pos > out_len)
+		die ("wtf");
+	if (out_pos == out_len)
+		out_pos = out_len = 0;
+}
+
 static void
 sock_send (char *str, int len) {
+	/* several solutions may come before the next poll, flush now */
+	while (out_len && out_len + len > BUF_SIZE)
+		sock_write ();
 	if (out_len + len > BUF_SIZE)
 		die ("send overflow");
 	memcpy (out_buf + out_len, str, len);
@@ -481,24 +568,24 @@ send_extranonce (void) {
 }
 
 static void
-send_submit (char *job_time, char *nonce_2, char *sol) {
+send_submit (char *job, char *job_time, char *nonce_2, char *sol) {
 	char		buf[BUF_SIZE];
 	static int	id = JSONRPC_ID_FIRST_SUBMIT;
 
 	snprintf (buf, BUF_SIZE - 1,
 	    "{\"id\":%d,\"method\":\"mining.submit\",\"params\":"
 	    "[\"%s\",\"%s\",\"%s\",\"%s\",\"%s\"]}\n",
-	    id++, worker_name, job_id, job_time, nonce_2, sol);
+	    id++, worker_name, job, job_time, nonce_2, sol);
 
 	sock_send (buf, strlen (buf));
 }
 
-int
-above_target (void) {
+static int
+above_target (block_t *b, int len) {
 	int		i;
 	uint8_t		diff[SHA256_DIGEST_SIZE];
 
-	sha256 ((uint8_t *)&block, sizeof (block), diff);
+	sha256 ((uint8_t *)b, len, diff);
 	sha256 (diff, SHA256_DIGEST_SIZE, diff);
 
 	if (flag_debug > 1) {
@@ -519,36 +606,42 @@ above_target (void) {
 	return -1;
 }
 
-int
-solution (void) {
+static int
+solution (equihash_ctx *ctx, block_t *b, void *arg) {
+	solver_t	*sv = arg;
 	char		nonce2[BUF_SIZE];
 	char		sol[BUF_SIZE];
-	char		job_time[sizeof (block.time) * 2 + 1];
+	char		job_time[sizeof (b->time) * 2 + 1];
+	int		ret = 0,
+			len = equihash_block_bytes (ctx);
 
+	pthread_mutex_lock (&mine_mutex);
 	stat_found++;
 	stat_found_cur++;
-	if (above_target ()) {
+	sv->run_found[ctx == sv->ctx2]++;
+	sv->found++;
+	if (above_target (b, len)) {
 		if (flag_debug)
 			printf ("above target\n");
-		return 0;
+		goto out;
 	}
 
-	hex (job_time, block.time, sizeof (block.time));
-	hex (nonce2, block.nonce + nonce1_len,
-	    sizeof (block.nonce) - nonce1_len);
-	hex (sol, block.solsize, sizeof (block.solsize));
-	hex (sol + sizeof (block.solsize) * 2, block.solution,
-	    sizeof (block.solution));
+	hex (job_time, b->time, sizeof (b->time));
+	hex (nonce2, b->nonce + nonce1_len,
+	    sizeof (b->nonce) - nonce1_len);
+	hex (sol, b->solsize, len - offsetof (block_t, solsize));
 
-	send_submit (job_time, nonce2, sol);
+	send_submit (sv->job_id, job_time, nonce2, sol);
 	stat_submitted++;
 
-	Log ("solution to %s submitted", job_id);
+	Log ("solution to %s submitted", sv->job_id);
 #if INTERRUPT
-	if (flag_new_job)
-		return 1;
+	if (stale (sv))
+		ret = sv->stopped = 1;
 #endif
-	return 0;
+out:
+	pthread_mutex_unlock (&mine_mutex);
+	return ret;
 }
 
 static void
@@ -578,37 +671,423 @@ periodic (int timeout) {
 			printf ("in buffer: %s", in_buf);
 		json_parse ();
 	}
-	if (pfd.revents & POLLOUT) {
-		if (flag_debug)
-			printf ("out buffer: %s", out_buf);
-		i = send (sock_fh, out_buf + out_pos, out_len - out_pos, 0);
-		if (i < 0)
-			die ("!send");
-		out_pos += i;
-		if (out_pos > out_len)
-			die ("wtf");
-		if (out_pos == out_len)
-			out_pos = out_len = 0;
-	}
+	if (pfd.revents & POLLOUT)
+		sock_write ();
 	if (pfd.revents & (POLLERR | POLLHUP))
 		die ("pollerr or pollhup");
 }
 
+/*
+ * -A 1 spreads solvers over NUMA nodes found in sysfs, solver n goes
+ * to node n % nodes.  its threads run on the cpus of the node only,
+ * and so does the thread equihash_new starts to touch the tables,
+ * so they are allocated there too
+ */
+#ifdef __linux__
+static int		numa_nodes;
+static int		numa_id[NODES_MAX];
+static cpu_set_t	numa_cpus[NODES_MAX];
+static cpu_set_t	numa_all;
+
+/* "0-3,8-11" */
 static void
-benchmark (int r) {
-	int		i, j;
+numa_cpulist (cpu_set_t *set, char *p) {
+	int		a, b;
+
+	CPU_ZERO (set);
+	while (*p >= '0' && *p <= '9') {
+		a = b = strtol (p, &p, 10);
+		if (*p == '-')
+			b = strtol (p + 1, &p, 10);
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET (a, set);
+		if (*p == ',')
+			p++;
+	}
+}
 
-	for (j = 0; j < r; j++) {
-		printf ("iteration %d\n", j);
-		block.nonce[0] = j;
-		block.nonce[1] = j >> 8;
-		block.nonce[2] = j >> 16;
-		block.nonce[3] = j >> 24;
-		step0 (&block);
-		for (i = 1; i <= WK; i++)
-			step (i);
+static void
+numa_init (void) {
+	FILE		*f;
+	char		path[BUF_SIZE], line[BUF_SIZE];
+	int		n;
+
+	if (sched_getaffinity (0, sizeof (numa_all), &numa_all))
+		die ("!sched_getaffinity");
+	for (n = 0; n < NODES_MAX * 4 && numa_nodes < NODES_MAX; n++) {
+		snprintf (path, sizeof (path),
+		    "/sys/devices/system/node/node%d/cpulist", n);
+		if (!(f = fopen (path, "r")))
+			continue;
+		if (fgets (line, sizeof (line), f)) {
+			numa_cpulist (&numa_cpus[numa_nodes], line);
+			/* memory-only nodes have no cpus */
+			if (CPU_COUNT (&numa_cpus[numa_nodes]))
+				numa_id[numa_nodes++] = n;
+		}
+		fclose (f);
+	}
+	if (!numa_nodes) {
+		numa_cpus[0] = numa_all;
+		numa_nodes = 1;
 	}
+	for (n = 0; n < numa_nodes; n++)
+		Log ("node %d: %d cpus", numa_id[n],
+		    CPU_COUNT (&numa_cpus[n]));
+}
+
+/* calling thread, and threads it starts from now on, to the node */
+static void
+numa_bind (int node) {
+	cpu_set_t	*set = node >= 0 ? &numa_cpus[node] : &numa_all;
+
+	if (flag_numa && sched_setaffinity (0, sizeof (*set), set))
+		die ("!sched_setaffinity");
+}
+#else
+static int		numa_nodes = 1;
+static int		numa_id[1];
+
+static void
+numa_init (void) {
+	die ("-A is for linux only");
+}
+
+#define numa_bind(node)		((void)0)
+#endif
+
+static void
+numa_print (double sec) {
+	int		n, i, cnt, found;
+
+	for (n = 0; n < numa_nodes; n++) {
+		for (i = cnt = found = 0; i < flag_solvers; i++)
+			if (solvers[i].node == n) {
+				cnt++;
+				found += solvers[i].found;
+			}
+		Log ("node %d: %d solvers %.2f Sol/s", numa_id[n], cnt,
+		    sec > 0 ? found / sec : 0.0);
+	}
+}
+
+/*
+ * -b N solves N headers made from the seed, so runs with the same
+ * seed and parameters do the same work and can be compared.  every
+ * solve and the summary are written as JSON lines
+ */
+static FILE		*bench_out;
+static double		bench_step_s[BENCH_STEPS_MAX];
+static long		bench_runs;
+static double		bench_sols, bench_sols2;
+
+static double
+now (void) {
+	struct timespec	ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * xorshift64 from seed and iteration.  nonce[BENCH_NONCE_BYTES..] stay
+ * zero as in pool headers, blake2b_zcash (200,9 and 192,7) hashes them
+ * as zeros
+ */
+static void
+bench_header (block_t *b, unsigned seed, int j) {
+	uint64_t	x = ((uint64_t)seed << 32 | (uint32_t)j)
+			    * 0x9e3779b97f4a7c15ull + 1;
+	uint8_t		*p = (uint8_t *)b;
+	int		i;
+
+	memset (b, 0, sizeof (*b));
+	for (i = 0; i < (int)offsetof (block_t, nonce) + BENCH_NONCE_BYTES;
+	    i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		p[i] = x;
+	}
+	unhex (b->version, sizeof (b->version), VERSION);
+}
+
+static void
+bench_cpu (char *buf, int len) {
+	FILE		*f;
+	char		line[BUF_SIZE], *p, *e;
+
+	snprintf (buf, len, "unknown");
+	f = fopen ("/proc/cpuinfo", "r");
+	if (!f)
+		return;
+	while (fgets (line, sizeof (line), f)) {
+		if (strncmp (line, "model name", 10) || !(p = strchr (line, ':')))
+			continue;
+		for (p++; *p == ' '; p++)
+			;
+		for (e = p; *e && *e != '\n' && *e != '"'; e++)
+			;
+		*e = 0;
+		snprintf (buf, len, "%s", p);
+		break;
+	}
+	fclose (f);
+}
+
+static void
+bench_run (solver_t *sv, int j, int r, double *t, int steps) {
+	int		i;
+
+	pthread_mutex_lock (&mine_mutex);
+	fprintf (bench_out, "{\"type\":\"run\",\"iter\":%d,"
+	    "\"solver\":%d,\"sols\":%d,\"step_ms\":[", j, sv->id,
+	    sv->run_found[r]);
+	for (i = 0; i <= steps; i++) {
+		fprintf (bench_out, "%s%.3f", i ? "," : "", t[i] * 1e3);
+		bench_step_s[i] += t[i];
+	}
+	fprintf (bench_out, "]}\n");
+	fflush (bench_out);
+	bench_runs++;
+	bench_sols += sv->run_found[r];
+	bench_sols2 += (double)sv->run_found[r] * sv->run_found[r];
+	pthread_mutex_unlock (&mine_mutex);
+}
+
+/*
+ * with -i a solver takes iterations j and j + solvers at once, and
+ * each of the two runs is given half of the time of the pair
+ */
+static void *
+benchmark_solver (void *arg) {
+	solver_t	*sv = arg;
+	block_t		next2;
+	int		i, j, pair,
+			stride = flag_solvers * (sv->ctx2 ? 2 : 1),
+			steps = equihash_steps (sv->ctx);
+	double		t[BENCH_STEPS_MAX], t0;
+
+	numa_bind (sv->node);
+	for (j = sv->id; j < flag_bench; j += stride) {
+		pair = sv->ctx2 && j + flag_solvers < flag_bench;
+		bench_header (&sv->block, flag_seed, j);
+		sv->run_found[0] = sv->run_found[1] = 0;
+		t0 = now ();
+		equihash_step0 (sv->ctx, &sv->block);
+		if (pair) {
+			bench_header (&sv->block2, flag_seed, j + flag_solvers);
+			equihash_step0 (sv->ctx2, &sv->block2);
+		}
+		t[0] = now () - t0;
+		for (i = 1; i <= steps; i++) {
+			if (i == steps + 1 - PIPE_STEPS &&
+			    j + stride < flag_bench) {
+				bench_header (&sv->next, flag_seed, j + stride);
+				equihash_step0_next (sv->ctx, &sv->next);
+				if (pair && j + stride + flag_solvers <
+				    flag_bench) {
+					bench_header (&next2, flag_seed,
+					    j + stride + flag_solvers);
+					equihash_step0_next (sv->ctx2, &next2);
+				}
+			}
+			t0 = now ();
+			if (pair)
+				equihash_step_pair (sv->ctx, sv->ctx2, i);
+			else
+				equihash_step (sv->ctx, i);
+			t[i] = now () - t0;
+		}
+
+		if (pair)
+			for (i = 0; i <= steps; i++)
+				t[i] /= 2;
+		bench_run (sv, j, 0, t, steps);
+		if (pair)
+			bench_run (sv, j + flag_solvers, 1, t, steps);
+	}
+	return NULL;
+}
+
+static void
+benchmark (void) {
+	int		n, i, steps = equihash_steps (solvers[0].ctx);
+	double		wall, mean, sd, ci;
+	char		cpu[BUF_SIZE];
+	struct rusage	ru;
+
+	if (!strcmp (bench_file, "-"))
+		bench_out = stdout;
+	else if (!(bench_out = fopen (bench_file, "a")))
+		die ("!can not open benchmark output");
+
+	wall = now ();
+	for (n = 0; n < flag_solvers; n++)
+		if (pthread_create (&solvers[n].tid, NULL, benchmark_solver,
+		    &solvers[n]))
+			die ("!pthread_create");
+	for (n = 0; n < flag_solvers; n++)
+		pthread_join (solvers[n].tid, NULL);
+	wall = now () - wall;
+
+	/* sols per solve is ~Poisson, 95% interval of its mean */
+	mean = bench_sols / bench_runs;
+	sd = bench_runs > 1 ? sqrt ((bench_sols2 - bench_sols * mean)
+	    / (bench_runs - 1)) : 0;
+	ci = 1.96 * sd / sqrt (bench_runs);
+	getrusage (RUSAGE_SELF, &ru);
+	bench_cpu (cpu, sizeof (cpu));
+
+	fprintf (bench_out, "{\"type\":\"summary\",\"n\":%d,\"k\":%d,"
+	    "\"threads\":%d,\"solvers\":%d,\"interleave\":%d,"
+	    "\"seed\":%u,\"runs\":%ld,"
+	    "\"sols\":%.0f,\"wall_s\":%.3f,\"sol_s\":%.3f,"
+	    "\"sol_s_ci95\":[%.3f,%.3f],\"sols_run\":%.3f,\"step_ms\":[",
+	    flag_n, flag_k, flag_threads, flag_solvers, flag_interleave,
+	    flag_seed, bench_runs, bench_sols, wall, bench_sols / wall,
+	    (mean - ci) * bench_runs / wall, (mean + ci) * bench_runs / wall,
+	    mean);
+	for (i = 0; i <= steps; i++)
+		fprintf (bench_out, "%s%.3f", i ? "," : "",
+		    bench_step_s[i] * 1e3 / bench_runs);
+	fprintf (bench_out, "],\"peak_rss_kb\":%ld,\"cpu\":\"%s\","
+	    "\"blake2b\":\"%s\"}\n", ru.ru_maxrss, cpu, blake2b_info ());
+	if (bench_out != stdout)
+		fclose (bench_out);
+
 	Log ("finished, %d total solutions", stat_found);
+	if (flag_numa)
+		numa_print (wall);
+	for (n = 0; n < flag_solvers; n++) {
+		Log ("solver %d: %s", n, equihash_info (solvers[n].ctx));
+		if (solvers[n].ctx2)
+			Log ("solver %d: %s", n, equihash_info (solvers[n].ctx2));
+	}
+}
+
+/*
+ * -C solves the headers below, made as -b does with seed CHECK_SEED,
+ * and compares the solutions found with the known ones.  a solution
+ * is kept as a fingerprint, hex of the first CHECK_FP_BYTES of sha256
+ * of its compact size and solution, and the list is sorted.  -d 2
+ * prints the whole blocks.  every solution passed a verifier of its
+ * own (blake2b of python hashlib), and every list is the whole set an
+ * exhaustive Wagner solver written apart from this one finds (all the
+ * pairs of every collision kept, only pairs repeating a leaf dropped)
+ */
+typedef struct {
+	int		n, k;
+	int		iter;
+	char		*sols;
+} check_t;
+
+static check_t		check_corpus[] = {
+	{ 200, 9, 0, "" },
+	{ 200, 9, 1, "c8984f2ba621a64a f0143140a967018e f0f93f7e75f90293" },
+	{ 200, 9, 2, "96dd53256004684e" },
+	{ 200, 9, 3, "faaedea873d7d34e" },
+	{ 200, 9, 4, "" },
+	{ 200, 9, 5, "" },
+	{ 200, 9, 6, "2d4c7cb9e30948b7 2de3512ea5677fa2 56067b104dbc9789 "
+	    "5919f87d5951371a" },
+	{ 200, 9, 7, "16cdae040cf9c842 484237da4bea5069 4bbe3f9c4fbc2cdf" },
+	{ 200, 9, 8, "82a6fa334b21f62f" },
+	{ 200, 9, 9, "" },
+	{ 200, 9, 10, "1d27bfbee0211642 de545568bd2b584b" },
+	{ 200, 9, 11, "892ae2fa77cb2a01 dbafd90f8ff2d899 de8182d2e10bf3ed" },
+	{ 200, 9, 12, "d0dd8515734ce801" },
+	{ 200, 9, 13, "0e3354213d06c62c b8c68f8bde8dd85b e581d0bea8e710ff" },
+	{ 200, 9, 14, "01e02ed5a66ba6fa 7c45b3c9df1dfacb cdfa773f092351f1 "
+	    "fa35c061aeb52132" },
+	{ 200, 9, 15, "5b65fdc525eeb193 92cd0a1d37ac51e4 bcae101121c7d26c" },
+	{ 144, 5, 0, "9653b1b469d3745c" },
+	{ 192, 7, 1, "374fe1fa867b3c0f e68cd39f5b38206e" },
+	{ 96, 5, 0, "425fde248d75fd1d b97e5c04149721dd" },
+	{ 96, 5, 1, "222a58d5b1f0590c 2b3436dd6b0d409a adaafd23fdd0289e "
+	    "f262eb8c3132a608" },
+	{ 96, 5, 2, "167dfa2b8344d5e8 367c94756f782fbb 8a62daaa1ffe25b4 "
+	    "a82dbd35868def24 fcf063f421135170" },
+	{ 96, 5, 3, "3c76c62bd917c1b6 c10abd2c03669951" },
+};
+
+#define CHECK_CORPUS	((int)(sizeof (check_corpus) / sizeof (check_corpus[0])))
+#define CHECK_FP_LEN	(CHECK_FP_BYTES * 2 + 1)
+
+typedef struct {
+	check_t		*c;
+	int		sols;
+	char		fp[CHECK_SOLS_MAX][CHECK_FP_LEN];
+} check_run_t;
+
+static int
+check_solution (equihash_ctx *ctx, block_t *b, void *arg) {
+	check_run_t	*r = arg;
+	uint8_t		digest[SHA256_DIGEST_SIZE];
+	char		buf[BUF_SIZE];
+
+	/* whole blocks for a verifier of its own */
+	if (flag_debug > 1) {
+		hex (buf, (uint8_t *)b, equihash_block_bytes (ctx));
+		printf ("sol %d %d %s\n", r->c->n, r->c->k, buf);
+	}
+	sha256 (b->solsize, equihash_block_bytes (ctx)
+	    - offsetof (block_t, solsize), digest);
+	if (r->sols < CHECK_SOLS_MAX)
+		hex (r->fp[r->sols], digest, CHECK_FP_BYTES);
+	r->sols++;
+	return 0;
+}
+
+static int
+check_cmp (const void *a, const void *b) {
+	return strcmp (a, b);
+}
+
+static int
+check (void) {
+	equihash_ctx	*ctx;
+	check_run_t	r;
+	block_t		b;
+	char		got[CHECK_SOLS_MAX * CHECK_FP_LEN];
+	int		i, j, n, failed = 0, skipped = 0;
+
+	for (i = 0; i < CHECK_CORPUS; i++) {
+		check_t		*c = &check_corpus[i];
+
+		ctx = equihash_new (c->n, c->k, flag_threads,
+		    check_solution, &r);
+		if (!ctx) {
+			skipped++;
+			continue;
+		}
+		bench_header (&b, CHECK_SEED, c->iter);
+		r.c = c;
+		r.sols = 0;
+		equihash_step0 (ctx, &b);
+		for (j = 1; j <= equihash_steps (ctx); j++)
+			equihash_step (ctx, j);
+		equihash_free (ctx);
+
+		if (r.sols > CHECK_SOLS_MAX)
+			r.sols = CHECK_SOLS_MAX;
+		qsort (r.fp, r.sols, CHECK_FP_LEN, check_cmp);
+		for (j = n = 0; j < r.sols; j++)
+			n += sprintf (got + n, "%s%s", j ? " " : "", r.fp[j]);
+		got[n] = 0;
+
+		if (strcmp (got, c->sols)) {
+			failed++;
+			Log ("check %d,%d iter %d FAILED", c->n, c->k, c->iter);
+			Log ("  expected %s", c->sols);
+			Log ("  got      %s", got);
+		} else if (flag_debug)
+			Log ("check %d,%d iter %d ok, %d solutions",
+			    c->n, c->k, c->iter, r.sols);
+	}
+	Log ("check: %d headers, %d failed, %d skipped as not compiled in",
+	    CHECK_CORPUS, failed, skipped);
+	return failed ? 1 : 0;
 }
 
 static void
@@ -622,6 +1101,16 @@ usage (char **argv) {
 	printf ("\t[-p worker_pass]\t# detault %s\n", worker_pass);
 	printf ("\t[-d debug_level]\t# default %d\n", flag_debug);
 	printf ("\t[-b benchmark_iters]\t# default %d\n", flag_bench);
+	printf ("\t[-S benchmark_seed]\t# default %u\n", flag_seed);
+	printf ("\t[-o benchmark_json]\t# default %s\n", bench_file);
+	printf ("\t[-C check_known]\t# default %d\n", flag_check);
+	printf ("\t[-A numa_bind]\t\t# default %d\n", flag_numa);
+	printf ("\t[-t threads]\t\t# default %d\n", flag_threads);
+	printf ("\t[-s solvers]\t\t# default %d\n", flag_solvers);
+	printf ("\t[-i interleave]\t\t# default %d\n", flag_interleave);
+	printf ("\t[-I finish_ms]\t\t# default %d\n", flag_finish);
+	printf ("\t[-n equihash_n]\t\t# default %d\n", flag_n);
+	printf ("\t[-k equihash_k]\t\t# default %d\n", flag_k);
 	exit (0);
 }
 
@@ -666,9 +1155,39 @@ arg_parse (int argc, char **argv) {
 		case 'b':
 			flag_bench = atoi (argv[i]);
 			break;
+		case 'C':
+			flag_check = atoi (argv[i]);
+			break;
+		case 'A':
+			flag_numa = atoi (argv[i]);
+			break;
+		case 'S':
+			flag_seed = strtoul (argv[i], NULL, 0);
+			break;
+		case 'o':
+			strncpy (bench_file, argv[i], BUF_SIZE - 1);
+			break;
 		case 'd':
 			flag_debug = atoi (argv[i]);
 			break;
+		case 't':
+			flag_threads = atoi (argv[i]);
+			break;
+		case 's':
+			flag_solvers = atoi (argv[i]);
+			break;
+		case 'i':
+			flag_interleave = atoi (argv[i]);
+			break;
+		case 'I':
+			flag_finish = atoi (argv[i]);
+			break;
+		case 'n':
+			flag_n = atoi (argv[i]);
+			break;
+		case 'k':
+			flag_k = atoi (argv[i]);
+			break;
 		default:
 			die ("unknown option, try -h");
 		}
@@ -679,6 +1198,7 @@ void
 stat_print (void) {
 	time_t		time_cur, t1;
 	float		speed_last;
+	int		n;
 
 	time (&time_cur);
 	if (time_cur - time_last < TIME_STAT_PERIOD)
@@ -692,10 +1212,17 @@ stat_print (void) {
 		speed_avg = speed_last;
 	speed_avg = speed_avg * (1 - STAT_ALPHA) + speed_last * STAT_ALPHA;
 	Log ("stat: cur %.2f Sol/s avg %.2f Sol/s, total %d send %d "
-	    "ok %d jobs %d interrupts %d",
+	    "ok %d jobs %d interrupts %d finished %d",
 	    speed_last, speed_avg,
 	    stat_found, stat_submitted,
-	    stat_accepted, stat_jobs, stat_interrupts);
+	    stat_accepted, stat_jobs, stat_interrupts, stat_finished);
+	for (n = 0; n < flag_solvers; n++) {
+		Log ("solver %d: %s", n, equihash_info (solvers[n].ctx));
+		if (solvers[n].ctx2)
+			Log ("solver %d: %s", n, equihash_info (solvers[n].ctx2));
+	}
+	if (flag_numa)
+		numa_print (time_cur - time_start);
 	time_prev = time_last;
 	time_last = time_cur;
 	stat_found_last = stat_found_cur;
@@ -703,66 +1230,212 @@ stat_print (void) {
 }
 
 static void
-nonce2_print (void) {
+nonce2_print (solver_t *sv) {
 	int			i;
 
-	for (i = NONCE_MAXLEN - 1; !block.nonce[i]
+	for (i = NONCE_MAXLEN - 1; !sv->block.nonce[i]
 	    && i > nonce1_len; i--)
 		;
-	printf ("nonce2 ");
+	printf ("solver %d nonce2 ", sv->id);
 	for (; i >= nonce1_len; i--)
-		printf ("%02x", block.nonce[i]);
+		printf ("%02x", sv->block.nonce[i]);
 	printf ("\n");
 }
 
 static void
-nonce2_reset (void) {
-	memset (block.nonce + nonce1_len, 0,
-	    sizeof (block.nonce) - nonce1_len);
-	block.nonce[nonce1_len] = 0x80;
+nonce2_add (block_t *b, int n) {
+	int		i;
+
+	for (i = nonce1_len; n && i < NONCE_MAXLEN; i++) {
+		n += b->nonce[i];
+		b->nonce[i] = n;
+		n >>= 8;
+	}
+	if (n)
+		die ("exhaused nonce");
 }
 
+/* called with mine_mutex held or from the only thread */
 static void
-nonce2_incr (void) {
-	int		i;
+solver_job (solver_t *sv) {
+	memcpy (&sv->block, &block, sizeof (block));
+	strcpy (sv->job_id, job_id);
+	sv->job_gen = job_gen;
+	sv->clean_gen = clean_gen;
+
+	memset (sv->block.nonce + nonce1_len, 0,
+	    sizeof (sv->block.nonce) - nonce1_len);
+	sv->block.nonce[nonce1_len] = 0x80;
+	nonce2_add (&sv->block, sv->id);
+}
 
-	for (i = nonce1_len; i < NONCE_MAXLEN; i++)
-		if (++block.nonce[i])
-			break;
-	if (i == NONCE_MAXLEN)
-		die ("exhaused nonce");
+#if INTERRUPT
+/*
+ * the solve of a job before a clean one is stopped, unless its steps
+ * left take less than -I ms by the averages of the solves before.
+ * the step being solved counts whole
+ */
+static int
+stale (solver_t *sv) {
+	int		i, steps = equihash_steps (sv->ctx);
+	double		left = 0;
+
+	if (sv->clean_gen == clean_gen || sv->keep_gen == clean_gen)
+		return 0;
+	for (i = sv->step; i <= steps; i++) {
+		if (!sv->step_ms[i])
+			return 1;	/* not timed yet */
+		left += sv->step_ms[i];
+	}
+	if (left >= flag_finish)
+		return 1;
+	sv->keep_gen = clean_gen;
+	return 0;
 }
 
-void
-mine (void) {
-	int		i;
+/* once the solve is stopped midway it stays so */
+static int
+interrupted (solver_t *sv) {
+	if (!sv->stopped && !stale (sv))
+		return 0;
+	pthread_mutex_lock (&mine_mutex);
+	stat_interrupts++;
+	pthread_mutex_unlock (&mine_mutex);
+	return 1;
+}
 
-	time (&time_start);
-	time_prev = time_last = time_start;
-	for (;;) {
+/*
+ * polled by the steps every few hundred boxes, so a new job stops the
+ * old one in a few ms instead of at the end of the step.  a single
+ * solver reads the pool from here too
+ */
+static int
+cancel (equihash_ctx *ctx, void *arg) {
+	solver_t	*sv = arg;
+
+	(void)ctx;
+	/* other threads of the step may be in solution () */
+	pthread_mutex_lock (&mine_mutex);
+	if (flag_solvers == 1)
 		periodic (0);
-		if (flag_new_job) {
-#if INTERRUPT
-NEW_JOB:
+	if (stale (sv))
+		sv->stopped = 1;
+	pthread_mutex_unlock (&mine_mutex);
+	return sv->stopped;
+}
 #endif
-			flag_new_job = 0;
-			nonce2_reset ();
+
+/*
+ * with -i the solver also solves block2, the nonce solvers ahead, and
+ * both move 2 * solvers nonces on
+ */
+static void
+solve (solver_t *sv) {
+	block_t		next2;
+	int		i, steps = equihash_steps (sv->ctx),
+			stride = flag_solvers * (sv->ctx2 ? 2 : 1);
+	double		t;
+
+	sv->stopped = 0;
+	equihash_step0 (sv->ctx, &sv->block);
+	if (sv->ctx2) {
+		memcpy (&sv->block2, &sv->block, sizeof (sv->block2));
+		nonce2_add (&sv->block2, flag_solvers);
+		equihash_step0 (sv->ctx2, &sv->block2);
+	}
+	for (i = 1; i <= steps; i++) {
+		if (i == steps + 1 - PIPE_STEPS) {
+			memcpy (&sv->next, &sv->block, sizeof (sv->next));
+			nonce2_add (&sv->next, stride);
+			equihash_step0_next (sv->ctx, &sv->next);
+			if (sv->ctx2) {
+				memcpy (&next2, &sv->next, sizeof (next2));
+				nonce2_add (&next2, flag_solvers);
+				equihash_step0_next (sv->ctx2, &next2);
+			}
 		}
-		if (flag_debug > 0)
-			nonce2_print ();
-		stat_print ();
-		step0 (&block);
-		for (i = 1; i <= WK; i++) {
+		sv->step = i;
 #if INTERRUPT
+		if (flag_solvers == 1)
 			periodic (0);
-			if (flag_new_job) {
-				stat_interrupts++;
-				goto NEW_JOB;
-			}
+		if (interrupted (sv))
+			return;
 #endif
-			step (i);
+		t = now ();
+		if (sv->ctx2)
+			equihash_step_pair (sv->ctx, sv->ctx2, i);
+		else
+			equihash_step (sv->ctx, i);
+		t = (now () - t) * 1e3;
+		/* steps of interrupted solves count too, unless cut short */
+		if (!sv->stopped)
+			sv->step_ms[i] = sv->step_ms[i] ? sv->step_ms[i] *
+			    (1 - STEP_ALPHA) + t * STEP_ALPHA : t;
+	}
+#if INTERRUPT
+	/* stopped in the last step, a stale one that got here is finished */
+	if (sv->stopped && interrupted (sv))
+		return;
+	if (sv->clean_gen != clean_gen) {
+		pthread_mutex_lock (&mine_mutex);
+		stat_finished++;
+		pthread_mutex_unlock (&mine_mutex);
+	}
+#endif
+	nonce2_add (&sv->block, stride);
+}
+
+static void *
+solver_loop (void *arg) {
+	solver_t	*sv = arg;
+
+	numa_bind (sv->node);
+	for (;;) {
+		if (sv->job_gen != job_gen) {
+			pthread_mutex_lock (&mine_mutex);
+			solver_job (sv);
+			pthread_mutex_unlock (&mine_mutex);
 		}
-		nonce2_incr ();
+		if (flag_debug > 0)
+			nonce2_print (sv);
+		solve (sv);
+	}
+	return NULL;
+}
+
+void
+mine (void) {
+	int		n;
+
+	time (&time_start);
+	time_prev = time_last = time_start;
+
+	if (flag_solvers == 1) {
+		solvers[0].job_gen = job_gen - 1;
+		numa_bind (solvers[0].node);
+		for (;;) {
+			periodic (0);
+			if (solvers[0].job_gen != job_gen)
+				solver_job (&solvers[0]);
+			if (flag_debug > 0)
+				nonce2_print (&solvers[0]);
+			stat_print ();
+			solve (&solvers[0]);
+		}
+	}
+
+	for (n = 0; n < flag_solvers; n++) {
+		solvers[n].job_gen = job_gen - 1;
+		if (pthread_create (&solvers[n].tid, NULL, solver_loop,
+		    &solvers[n]))
+			die ("!pthread_create");
+	}
+	for (;;) {
+		pthread_mutex_lock (&mine_mutex);
+		periodic (0);
+		stat_print ();
+		pthread_mutex_unlock (&mine_mutex);
+		poll (NULL, 0, POLL_PERIOD);
 	}
 }
 
@@ -773,25 +1446,61 @@ main (int argc, char **argv) {
 	setvbuf (stdout, NULL, _IONBF, 0);
 
 	Log ("Yet Another ZEC Miner, CPU miner for https://z.cash/");
-	Log ("BLAKE2b implementation: %s", blake2b_info ());
-	Log ("equihash info: %s", equihash_info ());
 
 	memset (&block, 0, sizeof (block));
 	arg_parse (argc, argv);
 
+	if (flag_check) {
+		Log ("BLAKE2b implementation: %s", blake2b_info ());
+		return check ();
+	}
+
+	if (flag_solvers < 1)
+		die ("bad number of solvers");
+	solvers = calloc (flag_solvers, sizeof (*solvers));
+	if (!solvers)
+		die ("no mem for solvers");
+	if (flag_numa)
+		numa_init ();
+	for (i = 0; i < flag_solvers; i++) {
+		solvers[i].id = i;
+		solvers[i].node = flag_numa ? i % numa_nodes : -1;
+		numa_bind (solvers[i].node);
+		solvers[i].ctx = equihash_new (flag_n, flag_k, flag_threads,
+		    solution, &solvers[i]);
+		if (!solvers[i].ctx)
+			die ("equihash parameters are not compiled in");
+		if (flag_interleave)
+			solvers[i].ctx2 = equihash_new (flag_n, flag_k,
+			    flag_threads, solution, &solvers[i]);
+	}
+	numa_bind (-1);
+
+	Log ("BLAKE2b implementation: %s", blake2b_info ());
+	Log ("equihash info: %s, solvers %d%s",
+	    equihash_info (solvers[0].ctx), flag_solvers,
+	    flag_interleave ? ", interleaved" : "");
+
 	if (flag_bench) {
-		benchmark (flag_bench);
+		benchmark ();
 		return 0;
 	}
 
+#if INTERRUPT
+	for (i = 0; i < flag_solvers; i++) {
+		equihash_set_cancel (solvers[i].ctx, cancel);
+		if (solvers[i].ctx2)
+			equihash_set_cancel (solvers[i].ctx2, cancel);
+	}
+#endif
 	Log ("connecting to %s:%d", pool_host, pool_port);
 	if (sock_fh < 0)
 		sock_open ();
 	Log ("connected!");
 	send_subscribe ();
-	for (i = 0; !flag_new_job && i < 10; i++)
+	for (i = 0; !job_gen && i < 10; i++)
 		periodic (1000);
-	if (!flag_new_job)
+	if (!job_gen)
 		die ("no responses or jobs");
 
 	mine ();